@@ -7,194 +7,947 @@
  * It might serve as an educational example though.
  */
 
+#define _GNU_SOURCE  // for syscall(), sched_setaffinity()
+
 #include <assert.h>
 #include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
-// Physical Memory Allocation, from raspberrypi/userland demo.
-#include "mailbox.h"
+// Uncached memory, DMA channels, pacing and streaming.
+#include "gpiodma.h"
+#include "gpiodma-regs.h"
 
 // GPIO which we want to toggle in this example.
 #define TOGGLE_GPIO 14
 
-// Raspberry Pi 2 or 1 ? Since this is a simple example, we don't
-// bother auto-detecting but have it a compile-time option.
-#ifndef PI_VERSION
-#  define PI_VERSION 2
-#endif
+// The board we are running on, from gpiodma_open().
+static const struct BoardInfo *board;
 
-#define BCM2708_PI1_PERI_BASE  0x20000000
-#define BCM2709_PI2_PERI_BASE  0x3F000000
-#define BCM2711_PI4_PERI_BASE  0xFE000000
+/* --------------------------------------------------------------------------
+ * The library returns its failures; this demo just gives up on them.
+ * --------------------------------------------------------------------------
+ */
+static void exit_if(int failed, const char *what) {
+  if (!failed) return;
+  fprintf(stderr, "%s failed.\n", what);
+  exit(1);
+}
 
-// --- General, Pi-specific setup.
-#if PI_VERSION == 1
-#  define PERI_BASE BCM2708_PI1_PERI_BASE
-#elif PI_VERSION == 2 || PI_VERSION == 3
-#  define PERI_BASE BCM2709_PI2_PERI_BASE
-#else
-#  define PERI_BASE BCM2711_PI4_PERI_BASE
-#endif
+static int choose_channel() {
+  const int channel = dma_channel_choose();
+  if (channel < 0) {
+    fprintf(stderr, "No free DMA channel found (mask 0x%04x); "
+            "choose one with -c\n", dma_channel_mask());
+    exit(1);
+  }
+  return channel;
+}
 
-#define PAGE_SIZE 4096
+static int choose_dma4_channel() {
+  const int channel = dma4_channel_choose();
+  if (channel < 0) {
+    fprintf(stderr, "No free DMA4 channel found; choose one with -c\n");
+    exit(1);
+  }
+  return channel;
+}
 
-// ---- GPIO specific defines
-#define GPIO_REGISTER_BASE 0x200000
-#define GPIO_SET_OFFSET 0x1C
-#define GPIO_CLR_OFFSET 0x28
-#define PHYSICAL_GPIO_BUS (0x7E000000 + GPIO_REGISTER_BASE)
+static struct UncachedMemBlock alloc_block(size_t size) {
+  struct UncachedMemBlock block = UncachedMemBlock_alloc(size);
+  exit_if(block.mem == NULL, "Allocating uncached memory");
+  return block;
+}
 
-// ---- Memory mappping defines
-#define BUS_TO_PHYS(x) ((x)&~0xC0000000)
+static struct UncachedMemPool create_pool_with_flags(size_t size,
+                                                     uint32_t flags) {
+  struct UncachedMemPool pool = UncachedMemPool_create_with_flags(size, flags);
+  exit_if(pool.block.mem == NULL, "Allocating uncached memory");
+  return pool;
+}
 
-// ---- Memory allocating defines
-// https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
-#define MEM_FLAG_DIRECT           (1 << 2)
-#define MEM_FLAG_COHERENT         (2 << 2)
-#define MEM_FLAG_L1_NONALLOCATING (MEM_FLAG_DIRECT | MEM_FLAG_COHERENT)
+static struct UncachedMemPool create_pool(size_t size) {
+  return create_pool_with_flags(size, board->mem_flags);
+}
 
-// ---- DMA specific defines
-#define DMA_CHANNEL       5   // That usually is free.
-#define DMA_BASE          0x007000
+/* --------------------------------------------------------------------------
+ * Parallel bus output. Bit i of each sample goes to GPIO pins[i].
+ *
+ * Rather than shuffling bits for each sample, we precompute a lookup table
+ * for each byte of the sample, that gives the GPIO bits to set; all other
+ * bits of the bus are to be cleared. So expanding a (up to) 16 bit sample is
+ * two lookups, one OR and one AND-NOT.
+ * --------------------------------------------------------------------------
+ */
+#define PARALLEL_BUS_MAX_WIDTH 16
 
-// BCM2385 ARM Peripherals 4.2.1.2
-#define DMA_CB_TI_NO_WIDE_BURSTS (1<<26)
-#define DMA_CB_TI_SRC_INC        (1<<8)
-#define DMA_CB_TI_DEST_INC       (1<<4)
-#define DMA_CB_TI_TDMODE         (1<<1)
+struct ParallelBus {
+  int width;                // Number of data bits.
+  uint32_t mask;            // All GPIO bits that are part of the bus.
+  uint32_t lut[2][256];     // GPIO bits to set for low and high sample byte.
+};
 
-#define DMA_CS_RESET    (1<<31)
-#define DMA_CS_ABORT    (1<<30)
-#define DMA_CS_DISDEBUG (1<<28)
-#define DMA_CS_END      (1<<1)
-#define DMA_CS_ACTIVE   (1<<0)
+// Set up bus with "width" data bits mapped to the given GPIO pins.
+static void ParallelBus_init(struct ParallelBus *bus,
+                             const int *pins, int width) {
+  assert(width > 0 && width <= PARALLEL_BUS_MAX_WIDTH);
+  memset(bus, 0, sizeof(*bus));
+  bus->width = width;
+  for (int bit = 0; bit < width; ++bit) {
+    assert(pins[bit] >= 0 && pins[bit] < 32);  // Only first GPIO bank.
+    bus->mask |= (1u << pins[bit]);
+  }
+  for (int value = 0; value < 256; ++value) {
+    for (int bit = 0; bit < width; ++bit) {
+      if (value & (1 << (bit % 8)))
+        bus->lut[bit / 8][value] |= (1u << pins[bit]);
+    }
+  }
+}
 
-#define DMA_CB_TXFR_LEN_YLENGTH(y) (((y-1)&0x4fff) << 16)
-#define DMA_CB_TXFR_LEN_XLENGTH(x) ((x)&0xffff)
-#define DMA_CB_STRIDE_D_STRIDE(x)  (((x)&0xffff) << 16)
-#define DMA_CB_STRIDE_S_STRIDE(x)  ((x)&0xffff)
+// GPIO bits to set for the given sample.
+static inline uint32_t ParallelBus_set_bits(const struct ParallelBus *bus,
+                                            uint16_t sample) {
+  return bus->lut[0][sample & 0xff] | bus->lut[1][sample >> 8];
+}
 
-#define DMA_CS_PRIORITY(x) ((x)&0xf << 16)
-#define DMA_CS_PANIC_PRIORITY(x) ((x)&0xf << 20)
+// Expand 16 bit samples to set/clr words to be written by the CPU.
+static void ParallelBus_expand(const struct ParallelBus *bus,
+                               const uint16_t *samples, int n,
+                               struct GPIOSetClr *out) {
+  for (int i = 0; i < n; ++i) {
+    const uint32_t set = ParallelBus_set_bits(bus, samples[i]);
+    out[i].set = set;
+    out[i].clr = bus->mask & ~set;
+  }
+}
 
+// Same as ParallelBus_expand(), for byte samples.
+static void ParallelBus_expand_bytes(const struct ParallelBus *bus,
+                                     const uint8_t *samples, int n,
+                                     struct GPIOSetClr *out) {
+  for (int i = 0; i < n; ++i) {
+    const uint32_t set = bus->lut[0][samples[i]];
+    out[i].set = set;
+    out[i].clr = bus->mask & ~set;
+  }
+}
 
-// Documentation: BCM2835 ARM Peripherals @4.2.1.2
-struct dma_channel_header {
-  uint32_t cs;        // control and status.
-  uint32_t cblock;    // control block address.
-};
+// Expand 16 bit samples to records to be sent by DMA. The lookup happens in
+// (cached) scratch memory, the records are written with
+// gpiodma_encode_records()
+static void ParallelBus_expand_regdata(const struct ParallelBus *bus,
+                                       const uint16_t *samples, int n,
+                                       struct GPIORegData *out) {
+  uint32_t set_bits[256];
+  for (int done = 0; done < n; /**/) {
+    const int batch = (n - done) > 256 ? 256 : (n - done);
+    for (int i = 0; i < batch; ++i) {
+      set_bits[i] = ParallelBus_set_bits(bus, samples[done + i]);
+    }
+    gpiodma_encode_records(set_bits, batch, bus->mask, out + done);
+    done += batch;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ * Feeding a DMAStream from another thread.
+ *
+ * Applications typically generate their output in a thread of their own.
+ * The SampleQueue hands the records from that producer to a refill thread
+ * that copies them into the DMAStream chunks. It is a single producer, single
+ * consumer ring: the producer only ever writes the head, the consumer only
+ * ever writes the tail, so no mutex is needed and neither side ever waits
+ * for the other: they just see a full or empty queue.
+ *
+ * If the queue runs empty while the DMA needs a chunk, the rest of the chunk
+ * is filled with records that neither set nor clear anything (the output
+ * holds its levels) and it is counted as an underrun.
+ * --------------------------------------------------------------------------
+ */
+struct SampleQueue {
+  struct GPIORegData *records;
+  uint32_t mask;    // Capacity - 1; capacity is a power of two.
 
-// @4.2.1.1
-struct dma_cb {    // 32 bytes.
-  uint32_t info;   // transfer information.
-  uint32_t src;    // physical source address.
-  uint32_t dst;    // physical destination address.
-  uint32_t length; // transfer length.
-  uint32_t stride; // stride mode.
-  uint32_t next;   // next control block; Physical address. 32 byte aligned.
-  uint32_t pad[2];
+  // Head and tail in their own cache line each, so that producer and
+  // consumer don't keep stealing the same cache line from each other.
+  uint32_t head __attribute__((aligned(64)));  // Producer writes here.
+  uint32_t tail __attribute__((aligned(64)));  // Consumer reads here.
+  int closed __attribute__((aligned(64)));     // No more data coming.
 };
 
-// A memory block that represents memory that is allocated in physical
-// memory and locked there so that it is not swapped out.
-// It is not backed by any L1 or L2 cache, so writing to it will directly
-// modify the physical memory (and it is slower of course to do so).
-// This is memory needed with DMA applications so that we can write through
-// with the CPU and have the DMA controller 'see' the data.
-// The UncachedMemBlock_{alloc,free,to_physical}
-// functions are meant to operate on these.
-struct UncachedMemBlock {
-  void *mem;                  // User visible value: the memory to use.
+static void SampleQueue_init(struct SampleQueue *queue, uint32_t capacity) {
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+  memset(queue, 0, sizeof(*queue));
+  queue->records
+    = (struct GPIORegData*) calloc(capacity, sizeof(struct GPIORegData));
+  assert(queue->records);
+  queue->mask = capacity - 1;
+}
+
+static void SampleQueue_free(struct SampleQueue *queue) {
+  free(queue->records);
+}
+
+// Producer: add up to "n" records. Returns the number added, which is less
+// than "n" if the queue is full.
+static int SampleQueue_push(struct SampleQueue *queue,
+                            const struct GPIORegData *records, int n) {
+  const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+  const uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+  const uint32_t space = (queue->mask + 1) - (head - tail);
+  if ((uint32_t)n > space) n = space;
+  for (int i = 0; i < n; ++i) {
+    queue->records[(head + i) & queue->mask] = records[i];
+  }
+  // Publish the records only after they are written.
+  __atomic_store_n(&queue->head, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+// Producer: signal that no more records are coming.
+static void SampleQueue_close(struct SampleQueue *queue) {
+  __atomic_store_n(&queue->closed, 1, __ATOMIC_RELEASE);
+}
+
+// Consumer: take up to "max" records. Returns the number taken.
+static int SampleQueue_pop(struct SampleQueue *queue,
+                           struct GPIORegData *out, int max) {
+  const uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  int n = head - tail;
+  if (n > max) n = max;
+  for (int i = 0; i < n; ++i) {
+    out[i] = queue->records[(tail + i) & queue->mask];
+  }
+  // Only now the producer may overwrite them.
+  __atomic_store_n(&queue->tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+// A DMAStream filled from a SampleQueue by a refill thread of its own.
+struct DMAFeeder {
+  struct SampleQueue queue;     // User visible: push records here.
+
   //-- Internal representation.
-  uint32_t bus_addr;
-  uint32_t mem_handle;
+  struct DMAStream stream;
+  pthread_t thread;
+  int stop;                     // Set to make the refill thread exit.
+  uint32_t underruns;           // Chunks the queue couldn't fill completely.
+  uint32_t missing_records;     // Records we had to replace with no-ops.
+};
+
+// DMAStreamFillFun: copy from the queue, pad with no-op records.
+static int fill_from_queue(void *user_data, struct GPIORegData *data, int n) {
+  struct DMAFeeder *feeder = (struct DMAFeeder*) user_data;
+  const int closed = __atomic_load_n(&feeder->queue.closed, __ATOMIC_ACQUIRE);
+  const int got = SampleQueue_pop(&feeder->queue, data, n);
+  if (got == 0 && closed)
+    return 0;  // End of stream.
+  if (got < n) {
+    memset(data + got, 0x00, (n - got) * sizeof(*data));
+    __atomic_add_fetch(&feeder->underruns, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&feeder->missing_records, n - got, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+static void *DMAFeeder_refill_thread(void *arg) {
+  struct DMAFeeder *feeder = (struct DMAFeeder*) arg;
+  while (!__atomic_load_n(&feeder->stop, __ATOMIC_ACQUIRE)) {
+    if (DMAStream_refill(&feeder->stream) < 0)
+      break;  // Producer closed the queue and everything is sent.
+    usleep(200);
+  }
+  return NULL;
+}
+
+// Set up a queue with room for "queue_records" records feeding a
+// DMAStream as described in DMAStream_init(). The DMA is started right away;
+// until the producer pushes data, no-op records are sent.
+static void DMAFeeder_start(struct DMAFeeder *feeder, int channel_number,
+                            int num_chunks, int chunk_records,
+                            uint32_t queue_records) {
+  memset(feeder, 0, sizeof(*feeder));
+  SampleQueue_init(&feeder->queue, queue_records);
+  exit_if(DMAStream_init(&feeder->stream, channel_number, num_chunks,
+                         chunk_records, fill_from_queue, feeder) != 0,
+          "Setting up the stream");
+  // Priming the chunks found the empty queue; that doesn't count.
+  feeder->underruns = 0;
+  feeder->missing_records = 0;
+  DMAStream_start(&feeder->stream);
+  const int err = pthread_create(&feeder->thread, NULL,
+                                 DMAFeeder_refill_thread, feeder);
+  assert(err == 0);
+  (void)err;
+}
+
+// Stop the refill thread and the DMA; free all resources.
+static void DMAFeeder_free(struct DMAFeeder *feeder) {
+  __atomic_store_n(&feeder->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(feeder->thread, NULL);
+  DMAStream_free(&feeder->stream);
+  SampleQueue_free(&feeder->queue);
+}
+
+/* --------------------------------------------------------------------------
+ * Waveform compiler.
+ *
+ * A waveform is given as a list of events: the GPIO levels and for how many
+ * ticks to hold them. Sending each tick as separate record wastes memory and
+ * DMA bandwidth for waveforms that hold their levels for a while; so the
+ * compiler merges consecutive events with the same levels and emits a chain
+ * of control blocks that needs only one record per run of identical levels:
+ *
+ *  - Paced by PWM (see pwm_pacing_start()), a tick is a PWM sample period.
+ *    Each run is one control block writing the record to GPIO, followed by
+ *    one 'delay block' feeding the PWM FIFO one word per tick of the
+ *    duration, which takes exactly that long.
+ *  - Unpaced, a tick is one write of the record. Each run is a 2D transfer
+ *    of the record YLENGTH times, with a source stride going back to the start
+ *    of the record. As YLENGTH is limited, longer runs need more blocks.
+ * --------------------------------------------------------------------------
+ */
+struct WaveformEvent {
+  uint32_t levels;   // GPIO levels; only bits in the waveform's mask count.
+  uint32_t ticks;    // Number of ticks to hold these.
+};
+
+struct CompiledWaveform {
+  struct UncachedMemBlock cb_block;    // The chain of control blocks.
+  struct UncachedMemBlock data_block;  // One record per run; FIFO word.
+  int num_cbs;
+  int num_records;
+};
+
+// Maximum number of ticks a single control block can wait or repeat.
+static uint32_t waveform_max_block_ticks(int paced) {
+  return paced ? DMA_CB_MAX_TXFR_LEN / sizeof(uint32_t) : DMA_CB_MAX_YLENGTH;
+}
+
+// Paced: control block setting the levels from the record once.
+static void waveform_set_levels_cb(struct dma_cb *cb, uint32_t record_addr) {
+  cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
+                DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP);
+  cb->src    = record_addr;
+  cb->dst    = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+  cb->length = sizeof(struct GPIORegData);
+  cb->stride = 0;
+}
+
+// Control block taking "ticks" (at most waveform_max_block_ticks()): paced,
+// a delay block feeding the PWM FIFO word; unpaced, writing the record
+// "ticks" times.
+static void waveform_hold_cb(struct dma_cb *cb, int paced, uint32_t ticks,
+                             uint32_t record_addr, uint32_t fifo_word_addr) {
+  if (paced) {
+    // One FIFO word per tick, each waiting for the DREQ.
+    cb->info   = (DMA_CB_TI_PERMAP(DMA_DREQ_PWM) | DMA_CB_TI_DEST_DREQ |
+                  DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP);
+    cb->src    = fifo_word_addr;
+    cb->dst    = PHYSICAL_PWM_BUS + PWM_FIF1_OFFSET;
+    cb->length = ticks * sizeof(uint32_t);
+    cb->stride = 0;
+  } else {
+    // Write the same record again and again: both source and destination
+    // stride back to the beginning.
+    cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
+                  DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_TDMODE);
+    cb->src    = record_addr;
+    cb->dst    = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+    cb->length = (DMA_CB_TXFR_LEN_YLENGTH(ticks) |
+                  DMA_CB_TXFR_LEN_XLENGTH(sizeof(struct GPIORegData)));
+    cb->stride = (DMA_CB_STRIDE_D_STRIDE(-16) |
+                  DMA_CB_STRIDE_S_STRIDE(-16));
+  }
+}
+
+// Count the control blocks (returned) and records needed for the events.
+static int compile_waveform_count(const struct WaveformEvent *events, int n,
+                                  uint32_t mask, int paced, int *num_records) {
+  const uint32_t max_ticks = waveform_max_block_ticks(paced);
+  int num_cbs = 0;
+  *num_records = 0;
+  for (int i = 0; i < n; /**/) {
+    uint64_t ticks = 0;
+    const uint32_t levels = events[i].levels & mask;
+    for (/**/; i < n && (events[i].levels & mask) == levels; ++i) {
+      ticks += events[i].ticks;
+    }
+    if (ticks == 0) continue;
+    const uint64_t blocks = (ticks + max_ticks - 1) / max_ticks;
+    num_cbs += paced ? 1 + blocks : blocks;
+    ++*num_records;
+  }
+  return num_cbs;
+}
+
+// Compile the events into a chain of control blocks from the pool. If "loop"
+// is set, the last control block links back to the first, otherwise the
+// DMA stops at the end. Returns 0 on success, -1 if there is nothing to send
+// or the pool is exhausted.
+static int compile_waveform(struct UncachedMemPool *pool,
+                            const struct WaveformEvent *events, int n,
+                            uint32_t mask, int paced, int loop,
+                            struct CompiledWaveform *out) {
+  memset(out, 0, sizeof(*out));
+  out->num_cbs = compile_waveform_count(events, n, mask, paced,
+                                        &out->num_records);
+  if (out->num_cbs == 0) return -1;
+  out->cb_block = UncachedMemPool_alloc(pool,
+                                        out->num_cbs * sizeof(struct dma_cb));
+  out->data_block = UncachedMemPool_alloc(
+    pool, out->num_records * sizeof(struct GPIORegData) + sizeof(uint32_t));
+  if (!out->cb_block.mem || !out->data_block.mem) {
+    UncachedMemPool_free(pool, &out->cb_block);
+    UncachedMemPool_free(pool, &out->data_block);
+    return -1;
+  }
+
+  struct dma_cb *cbs = (struct dma_cb*) out->cb_block.mem;
+  struct GPIORegData *records = (struct GPIORegData*) out->data_block.mem;
+  uint32_t *fifo_word = (uint32_t*) (records + out->num_records);
+  struct dma_cb *cb = cbs;
+  struct GPIORegData *record = records;
+  const uint32_t fifo_word_addr
+    = UncachedMemBlock_to_physical(&out->data_block, fifo_word);
+  const uint32_t max_ticks = waveform_max_block_ticks(paced);
+
+  for (int i = 0; i < n; /**/) {
+    uint64_t ticks = 0;
+    const uint32_t levels = events[i].levels & mask;
+    for (/**/; i < n && (events[i].levels & mask) == levels; ++i) {
+      ticks += events[i].ticks;
+    }
+    if (ticks == 0) continue;
+
+    gpiodma_encode_records(&levels, 1, mask, record);
+    const uint32_t record_addr
+      = UncachedMemBlock_to_physical(&out->data_block, record);
+    ++record;
+
+    if (paced) {
+      // Set the levels once, then wait.
+      waveform_set_levels_cb(cb++, record_addr);
+    }
+    while (ticks > 0) {
+      const uint32_t block_ticks = ticks > max_ticks ? max_ticks : ticks;
+      waveform_hold_cb(cb++, paced, block_ticks, record_addr, fifo_word_addr);
+      ticks -= block_ticks;
+    }
+  }
+  assert(cb - cbs == out->num_cbs);
+
+  // Link them all up.
+  for (int i = 0; i < out->num_cbs; ++i) {
+    if (i + 1 < out->num_cbs)
+      cbs[i].next = UncachedMemBlock_to_physical(&out->cb_block, &cbs[i+1]);
+    else
+      cbs[i].next = loop ? out->cb_block.bus_addr : 0;
+  }
+  return 0;
+}
+
+// Return the memory of a compiled waveform to the pool.
+static void CompiledWaveform_free(struct UncachedMemPool *pool,
+                                  struct CompiledWaveform *waveform) {
+  UncachedMemPool_free(pool, &waveform->cb_block);
+  UncachedMemPool_free(pool, &waveform->data_block);
+}
+
+/* --------------------------------------------------------------------------
+ * Run-length encoded waveforms, decoded just in time.
+ *
+ * Compiling a waveform needs all its control blocks in locked memory at
+ * once. For long waveforms, we keep them run-length encoded instead: each run
+ * of identical levels is two LEB128 varints, the number of ticks and the
+ * levels XOR the previous levels; typically just a few bytes per run.
+ *
+ * The RleStream decodes this just in time into a ring of slots, each holding
+ * one run (or a part of a long one): the record and the control blocks as
+ * emitted by the waveform compiler. Just like the DMAStream, the CPU refills
+ * the slots the DMA already left behind.
+ * --------------------------------------------------------------------------
+ */
+static uint8_t *rle_put_varint(uint8_t *out, uint32_t value) {
+  while (value >= 0x80) {
+    *out++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+  return out;
+}
+
+// Encode the events, merging consecutive events with the same levels. "out"
+// needs to have room for 10 bytes per event. Returns the number of bytes
+// written.
+static size_t rle_encode(const struct WaveformEvent *events, int n,
+                         uint32_t mask, uint8_t *out) {
+  uint8_t *pos = out;
+  uint32_t previous = 0;
+  for (int i = 0; i < n; /**/) {
+    uint64_t ticks = 0;
+    const uint32_t levels = events[i].levels & mask;
+    for (/**/; i < n && (events[i].levels & mask) == levels; ++i) {
+      ticks += events[i].ticks;
+    }
+    while (ticks > 0) {   // Runs longer than 32 bits are split.
+      const uint32_t run = ticks > UINT32_MAX ? UINT32_MAX : ticks;
+      pos = rle_put_varint(pos, run);
+      pos = rle_put_varint(pos, levels ^ previous);
+      previous = levels;
+      ticks -= run;
+    }
+  }
+  return pos - out;
+}
+
+struct RleDecoder {
+  const uint8_t *data;
   size_t size;
+  int loop;                // Start over at the end.
+
+  //-- Internal representation.
+  size_t pos;
+  uint32_t levels;
+  uint32_t pending_ticks;  // Ticks left in the current run.
+};
+
+static int rle_get_varint(struct RleDecoder *dec, uint32_t *value) {
+  *value = 0;
+  for (int shift = 0; dec->pos < dec->size && shift < 32; shift += 7) {
+    const uint8_t b = dec->data[dec->pos++];
+    *value |= (uint32_t)(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return 1;
+  }
+  return 0;
+}
+
+// Get the levels and the ticks (at most "max_ticks") to hold them next.
+// Returns 0 at the end.
+static int RleDecoder_next(struct RleDecoder *dec, uint32_t max_ticks,
+                           uint32_t *levels, uint32_t *ticks) {
+  while (dec->pending_ticks == 0) {
+    if (dec->pos >= dec->size) {
+      if (!dec->loop || dec->size == 0) return 0;
+      dec->pos = 0;
+      dec->levels = 0;
+    }
+    uint32_t delta;
+    if (!rle_get_varint(dec, &dec->pending_ticks) ||
+        !rle_get_varint(dec, &delta))
+      return 0;  // Truncated.
+    dec->levels ^= delta;
+  }
+  *levels = dec->levels;
+  *ticks = dec->pending_ticks > max_ticks ? max_ticks : dec->pending_ticks;
+  dec->pending_ticks -= *ticks;
+  return 1;
+}
+
+struct RleStream {
+  struct RleDecoder *decoder;
+  uint32_t mask;
+  int paced;
+  int num_slots;
+
+  //-- Internal representation.
+  int cbs_per_slot;
+  volatile struct dma_channel_header *channel;
+  struct UncachedMemPool pool;
+  struct UncachedMemBlock cb_block;    // num_slots * cbs_per_slot.
+  struct UncachedMemBlock data_block;  // num_slots records; FIFO word.
+  int next_refill;
+  int finished;
 };
 
-static int mbox_fd = -1;   // used internally by the UncachedMemBlock-functions.
+// Decode the next run into slot "i".
+static void RleStream_fill_slot(struct RleStream *stream, int i) {
+  struct dma_cb *cbs
+    = (struct dma_cb*) stream->cb_block.mem + i * stream->cbs_per_slot;
+  struct GPIORegData *records = (struct GPIORegData*) stream->data_block.mem;
+  struct GPIORegData *record = records + i;
+  const uint32_t record_addr
+    = UncachedMemBlock_to_physical(&stream->data_block, record);
+  const uint32_t fifo_word_addr
+    = UncachedMemBlock_to_physical(&stream->data_block,
+                                   records + stream->num_slots);
+  struct dma_cb *last = &cbs[stream->cbs_per_slot - 1];
+
+  uint32_t levels, ticks;
+  if (stream->finished ||
+      !RleDecoder_next(stream->decoder, waveform_max_block_ticks(stream->paced),
+                       &levels, &ticks)) {
+    // End of the waveform: a last record that neither sets nor clears
+    // anything, then stop.
+    memset(record, 0x00, sizeof(*record));
+    ticks = 1;
+    last->next = 0;
+    stream->finished = 1;
+  } else {
+    gpiodma_encode_records(&levels, 1, stream->mask, record);
+  }
+
+  if (stream->paced) waveform_set_levels_cb(&cbs[0], record_addr);
+  waveform_hold_cb(last, stream->paced, ticks, record_addr, fifo_word_addr);
+  gpiodma_sync_for_dma(record, sizeof(*record));
+  gpiodma_sync_for_dma(cbs, stream->cbs_per_slot * sizeof(struct dma_cb));
+}
+
+// Set up a stream with "num_slots" slots decoding from the decoder; all
+// slots are filled, but the DMA is not started yet.
+static void RleStream_init(struct RleStream *stream, int channel_number,
+                           struct RleDecoder *decoder, uint32_t mask,
+                           int paced, int num_slots) {
+  assert(num_slots >= 2);
+  memset(stream, 0, sizeof(*stream));
+  stream->decoder = decoder;
+  stream->mask = mask;
+  stream->paced = paced;
+  stream->num_slots = num_slots;
+  stream->cbs_per_slot = paced ? 2 : 1;
+  stream->channel = dma_channel_claim(channel_number);
+
+  const size_t cb_size
+    = num_slots * stream->cbs_per_slot * sizeof(struct dma_cb);
+  const size_t data_size
+    = num_slots * sizeof(struct GPIORegData) + sizeof(uint32_t);
+  stream->pool = create_pool(UncachedMemPool_chunk_size(cb_size) +
+                             UncachedMemPool_chunk_size(data_size));
+  stream->cb_block = UncachedMemPool_alloc(&stream->pool, cb_size);
+  stream->data_block = UncachedMemPool_alloc(&stream->pool, data_size);
+  assert(stream->cb_block.mem && stream->data_block.mem);
+  memset(stream->data_block.mem, 0x00, data_size);
+
+  // Link all control blocks in a ring; only the end of the waveform breaks it.
+  struct dma_cb *cbs = (struct dma_cb*) stream->cb_block.mem;
+  const int num_cbs = num_slots * stream->cbs_per_slot;
+  for (int i = 0; i < num_cbs; ++i) {
+    cbs[i].next = UncachedMemBlock_to_physical(&stream->cb_block,
+                                               &cbs[(i + 1) % num_cbs]);
+  }
+  for (int i = 0; i < num_slots; ++i) {
+    RleStream_fill_slot(stream, i);
+  }
+}
+
+static void RleStream_start(struct RleStream *stream) {
+  stream->next_refill = 0;
+  dma_channel_start(stream->channel, stream->cb_block.bus_addr);
+}
+
+// Decode into all slots the DMA is done with. Returns the number of slots
+// refilled, or -1 once the waveform has been sent completely.
+static int RleStream_refill(struct RleStream *stream) {
+  const uint32_t active_cb = stream->channel->cblock;
+  const uint32_t slot_size = stream->cbs_per_slot * sizeof(struct dma_cb);
+  const uint32_t cb_offset = active_cb - stream->cb_block.bus_addr;
+  if (active_cb == 0 || cb_offset >= stream->num_slots * slot_size)
+    return stream->finished ? -1 : 0;
+  const int active = cb_offset / slot_size;
 
-// Allocate a block of memory of the given size (which is rounded up to the next
-// full page). The memory will be aligned on a page boundary and zeroed out.
-static struct UncachedMemBlock UncachedMemBlock_alloc(size_t size) {
-  if (mbox_fd < 0) {
-    mbox_fd = mbox_open();
-    assert(mbox_fd >= 0);  // Uh, /dev/vcio not there ?
+  int refilled = 0;
+  while (stream->next_refill != active && !stream->finished) {
+    RleStream_fill_slot(stream, stream->next_refill);
+    stream->next_refill = (stream->next_refill + 1) % stream->num_slots;
+    ++refilled;
   }
-  // Round up to next full page.
-  size = size % PAGE_SIZE == 0 ? size : (size + PAGE_SIZE) & ~(PAGE_SIZE - 1);
+  return refilled;
+}
+
+static void RleStream_free(struct RleStream *stream) {
+  dma_channel_stop(stream->channel);
+  UncachedMemPool_free(&stream->pool, &stream->cb_block);
+  UncachedMemPool_free(&stream->pool, &stream->data_block);
+  UncachedMemPool_destroy(&stream->pool);
+}
+
+// Memory used by the stream. Each slot holds a run of any length, so the
+// samples are given by the caller: the ticks of "num_slots" average runs.
+static void RleStream_footprint(const struct RleStream *stream, int samples,
+                                struct DMAFootprint *fp) {
+  fp->cb_bytes = stream->cb_block.requested_size;
+  fp->payload_bytes = stream->data_block.requested_size;
+  fp->locked_bytes = stream->pool.block.size;
+  fp->samples = samples;
+}
+
+/* --------------------------------------------------------------------------
+ * Striping output across multiple DMA channels.
+ *
+ * A single DMA channel only manages a few million writes per second. The
+ * DMAStriped engine splits one sequence of records across several (full)
+ * channels: with k channels, channel i gets records i, i+k, i+2k, ...
+ *
+ * Each channel simply sends its slice as fast as it can; the channels are
+ * not synchronized at all, so this shows what aggregate rate the DMA
+ * subsystem sustains, but it can't keep a single stream in order. Pacing
+ * doesn't help: all channels would wait for the same DREQ, and which one
+ * gets to send next is up to the DMA arbiter. So the output is only the
+ * intended waveform if all records are the same; that is what the
+ * benchmark does.
+ * --------------------------------------------------------------------------
+ */
+#define DMA_STRIPE_MAX_CHANNELS 4
+
+struct DMAStriped {
+  int num_channels;
+  volatile struct dma_channel_header *channel[DMA_STRIPE_MAX_CHANNELS];
+  struct UncachedMemPool pool;
+  struct UncachedMemBlock cb_block[DMA_STRIPE_MAX_CHANNELS];
+  struct UncachedMemBlock data_block[DMA_STRIPE_MAX_CHANNELS];
+};
 
-  struct UncachedMemBlock result;
-  result.size = size;
-  result.mem_handle = mem_alloc(mbox_fd, size, PAGE_SIZE,
-                                MEM_FLAG_L1_NONALLOCATING);
-  result.bus_addr = mem_lock(mbox_fd, result.mem_handle);
-  result.mem = mapmem(BUS_TO_PHYS(result.bus_addr), size);
-  fprintf(stderr, "Alloc: %6d bytes;  %p (bus=0x%08x, phys=0x%08x)\n",
-          (int)size, result.mem, result.bus_addr, BUS_TO_PHYS(result.bus_addr));
-  assert(result.bus_addr);  // otherwise: couldn't allocate contiguous block.
-  memset(result.mem, 0x00, size);
+// Set up the "n" records to be striped across the given channels. Each
+// channel sends its slice "repeat" times, then stops; if repeat is 0 it loops
+// forever.
+static void DMAStriped_init(struct DMAStriped *striped,
+                            const int *channels, int num_channels,
+                            const struct GPIORegData *records, int n,
+                            int repeat) {
+  assert(num_channels > 0 && num_channels <= DMA_STRIPE_MAX_CHANNELS);
+  memset(striped, 0, sizeof(*striped));
+  striped->num_channels = num_channels;
 
-  return result;
+  const int slice_len = (n + num_channels - 1) / num_channels;
+  const int reps = repeat > 0 ? repeat : 1;
+  const int cbs_per_rep = gpiodma_record_chain_length(slice_len);
+  const size_t data_size = slice_len * sizeof(struct GPIORegData);
+  const size_t cb_size = (size_t)reps * cbs_per_rep * sizeof(struct dma_cb);
+  striped->pool = create_pool(
+    num_channels * (UncachedMemPool_chunk_size(data_size) +
+                    UncachedMemPool_chunk_size(cb_size)));
+
+  for (int c = 0; c < num_channels; ++c) {
+    assert(channels[c] <= DMA_MAX_FULL_CHANNEL);  // Need 2D: no Lite channel.
+    striped->channel[c] = dma_channel_claim(channels[c]);
+    struct UncachedMemBlock *data_block = &striped->data_block[c];
+    struct UncachedMemBlock *cb_block = &striped->cb_block[c];
+    *data_block = UncachedMemPool_alloc(&striped->pool, data_size);
+    *cb_block = UncachedMemPool_alloc(&striped->pool, cb_size);
+    assert(data_block->mem && cb_block->mem);
+
+    // Collect this channel's slice. If n is not a multiple of the number of
+    // channels, the last slices are padded with records that don't do
+    // anything.
+    struct GPIORegData *slice = (struct GPIORegData*) data_block->mem;
+    for (int i = 0; i < slice_len; ++i) {
+      const int record = i * num_channels + c;
+      if (record < n) slice[i] = records[record];
+    }
+
+    struct dma_cb *cbs = (struct dma_cb*) cb_block->mem;
+    for (int r = 0; r < reps; ++r) {
+      struct dma_cb *rep_cbs = cbs + r * cbs_per_rep;
+      const uint32_t next = (r + 1 < reps)
+        ? UncachedMemBlock_to_physical(cb_block, rep_cbs + cbs_per_rep)
+        : (repeat == 0 ? cb_block->bus_addr : 0);
+      gpiodma_build_record_chain(cb_block, rep_cbs, data_block,
+                                 slice, slice_len, next);
+    }
+  }
+  UncachedMemBlock_sync_for_dma(&striped->pool.block);
+}
+
+// Start all channels, as close together as possible.
+static void DMAStriped_start(struct DMAStriped *striped,
+                             int priority, int panic_priority) {
+  for (int c = 0; c < striped->num_channels; ++c) {
+    dma_channel_start_with_priority(striped->channel[c],
+                                    striped->cb_block[c].bus_addr,
+                                    priority, panic_priority);
+  }
 }
 
-// Free block previously allocated with UncachedMemBlock_alloc()
-static void UncachedMemBlock_free(struct UncachedMemBlock *block) {
-  if (block->mem == NULL) return;
-  assert(mbox_fd >= 0);  // someone should've initialized that on allocate.
-  unmapmem(block->mem, block->size);
-  mem_unlock(mbox_fd, block->mem_handle);
-  mem_free(mbox_fd, block->mem_handle);
-  block->mem = NULL;
+// Returns if any of the channels is still sending.
+static int DMAStriped_active(const struct DMAStriped *striped) {
+  for (int c = 0; c < striped->num_channels; ++c) {
+    if (striped->channel[c]->cs & DMA_CS_ACTIVE) return 1;
+  }
+  return 0;
 }
 
+// Stop all channels and free the memory.
+static void DMAStriped_free(struct DMAStriped *striped) {
+  for (int c = 0; c < striped->num_channels; ++c) {
+    dma_channel_stop(striped->channel[c]);
+    UncachedMemPool_free(&striped->pool, &striped->cb_block[c]);
+    UncachedMemPool_free(&striped->pool, &striped->data_block[c]);
+  }
+  UncachedMemPool_destroy(&striped->pool);
+}
 
-// Given a pointer to memory that is in the allocated block, return the
-// physical bus addresse needed by DMA operations.
-static uintptr_t UncachedMemBlock_to_physical(const struct UncachedMemBlock *blk,
-                                              void *p) {
-    uint32_t offset = (uint8_t*)p - (uint8_t*)blk->mem;
-    assert(offset < blk->size);   // pointer not within our block.
-    return blk->bus_addr + offset;
+// Memory used by all channels together.
+static void DMAStriped_footprint(const struct DMAStriped *striped, int n,
+                                 struct DMAFootprint *fp) {
+  memset(fp, 0, sizeof(*fp));
+  for (int c = 0; c < striped->num_channels; ++c) {
+    fp->cb_bytes += striped->cb_block[c].requested_size;
+    fp->payload_bytes += striped->data_block[c].requested_size;
+  }
+  fp->locked_bytes = striped->pool.block.size;
+  fp->samples = n;
 }
 
-// Return a pointer to a periphery subsystem register.
-static void *mmap_bcm_register(off_t register_offset) {
-  const off_t base = PERI_BASE;
+/* --------------------------------------------------------------------------
+ * Waveform files.
+ *
+ * Prerecorded waveforms are stored as a header followed by packed set/clr
+ * records, the same layout as struct GPIOData in
+ * run_cpu_from_memory_set_reset(). For playback, the file is not read into
+ * memory, let alone into locked VC memory: it is mmap()ed and the records
+ * are expanded directly from the page cache into the DMAStream chunks. The
+ * kernel is told to read ahead the part we need next and to drop what we have
+ * already sent, so files of any size play with a few pages of memory.
+ * --------------------------------------------------------------------------
+ */
+#define WAVEFORM_FILE_MAGIC "GPIODMA1"
+#define WAVEFORM_FILE_READAHEAD (1 << 20)   // Bytes to read ahead.
+
+struct WaveformFileHeader {
+  char magic[8];           // WAVEFORM_FILE_MAGIC, not null terminated.
+  uint32_t record_size;    // sizeof(struct GPIOSetClr)
+  uint32_t reserved;       // 0
+  uint64_t num_records;    // Number of records following the header.
+};
+
+struct WaveformFile {
+  const struct GPIOSetClr *records;
+  uint64_t num_records;
+
+  //-- Internal representation.
+  const uint8_t *map;
+  size_t map_size;
+  uint64_t pos;            // Next record to play.
+  uint64_t advised_until;  // Records up to here we asked to be read ahead.
+  uint64_t released_until; // Records before this are dropped already.
+};
 
-  int mem_fd;
-  if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-    perror("can't open /dev/mem: ");
-    fprintf(stderr, "You need to run this as root!\n");
-    return NULL;
+// Write "n" records to a new waveform file. Returns 0 on success.
+static int write_waveform_file(const char *filename,
+                               const struct GPIOSetClr *records, uint64_t n) {
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    perror(filename);
+    return -1;
   }
+  struct WaveformFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, WAVEFORM_FILE_MAGIC, sizeof(header.magic));
+  header.record_size = sizeof(struct GPIOSetClr);
+  header.num_records = n;
+  const int ok = (fwrite(&header, sizeof(header), 1, f) == 1 &&
+                  fwrite(records, sizeof(*records), n, f) == n);
+  return (fclose(f) == 0 && ok) ? 0 : -1;
+}
 
-  uint32_t *result =
-    (uint32_t*) mmap(NULL,                  // Any adddress in our space will do
-                     PAGE_SIZE,
-                     PROT_READ|PROT_WRITE,  // Enable r/w on GPIO registers.
-                     MAP_SHARED,
-                     mem_fd,                // File to map
-                     base + register_offset // Offset to bcm register
-                     );
-  close(mem_fd);
+// Map the waveform file for playback. Returns 0 on success.
+static int WaveformFile_open(struct WaveformFile *wf, const char *filename) {
+  memset(wf, 0, sizeof(*wf));
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct WaveformFileHeader)) {
+    fprintf(stderr, "%s: not a waveform file.\n", filename);
+    close(fd);
+    return -1;
+  }
+  wf->map_size = st.st_size;
+  wf->map = (const uint8_t*) mmap(NULL, wf->map_size, PROT_READ, MAP_SHARED,
+                                  fd, 0);
+  close(fd);  // The mapping stays valid.
+  if (wf->map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
 
-  if (result == MAP_FAILED) {
-    fprintf(stderr, "mmap error %p\n", result);
-    return NULL;
+  const struct WaveformFileHeader *header
+    = (const struct WaveformFileHeader*) wf->map;
+  if (memcmp(header->magic, WAVEFORM_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->record_size != sizeof(struct GPIOSetClr) ||
+      header->num_records > (wf->map_size - sizeof(*header))
+      / sizeof(struct GPIOSetClr)) {
+    fprintf(stderr, "%s: not a waveform file or truncated.\n", filename);
+    munmap((void*)wf->map, wf->map_size);
+    return -1;
   }
-  return result;
+  wf->records = (const struct GPIOSetClr*) (header + 1);
+  wf->num_records = header->num_records;
+
+  // We go through from start to end and look at everything only once.
+  madvise((void*)wf->map, wf->map_size, MADV_SEQUENTIAL);
+  return 0;
+}
+
+static void WaveformFile_close(struct WaveformFile *wf) {
+  munmap((void*)wf->map, wf->map_size);
 }
 
-void initialize_gpio_for_output(volatile uint32_t *gpio_registerset, int bit) {
-  *(gpio_registerset+(bit/10)) &= ~(7<<((bit%10)*3));  // prepare: set as input
-  *(gpio_registerset+(bit/10)) |=  (1<<((bit%10)*3));  // set as output.
+// Page aligned address range of the given records within the mapping.
+static void WaveformFile_advise(const struct WaveformFile *wf,
+                                uint64_t from, uint64_t to, int advice) {
+  // madvise() works on whole pages. Dropping must not cover the page we are
+  // still sending from, so round the end down there; reading ahead includes
+  // the partial page at the end.
+  const uintptr_t page_mask = GPIODMA_PAGE_SIZE - 1;
+  const uintptr_t begin = (uintptr_t)(wf->records + from) & ~page_mask;
+  uintptr_t end = (uintptr_t)(wf->records + to);
+  if (advice == MADV_DONTNEED)
+    end &= ~page_mask;
+  else
+    end = (end + page_mask) & ~page_mask;
+  if (end > begin) madvise((void*)begin, end - begin, advice);
+}
+
+// DMAStreamFillFun: expand the next records of the file.
+static int fill_from_waveform_file(void *user_data,
+                                   struct GPIORegData *data, int n) {
+  struct WaveformFile *wf = (struct WaveformFile*) user_data;
+  const uint64_t remaining = wf->num_records - wf->pos;
+  if ((uint64_t)n > remaining) n = remaining;
+
+  // Keep the kernel reading ahead of us ...
+  const uint64_t readahead = WAVEFORM_FILE_READAHEAD / sizeof(struct GPIOSetClr);
+  if (wf->advised_until < wf->pos + readahead / 2) {
+    uint64_t until = wf->pos + readahead;
+    if (until > wf->num_records) until = wf->num_records;
+    WaveformFile_advise(wf, wf->pos, until, MADV_WILLNEED);
+    wf->advised_until = until;
+  }
+
+  const struct GPIOSetClr *in = wf->records + wf->pos;
+  for (int i = 0; i < n; ++i) {
+    // Build the full record locally, then write it in one go to the
+    // uncached memory.
+    const struct GPIORegData record = { in[i].set, 0, 0, in[i].clr };
+    data[i] = record;
+  }
+
+  // ... and drop what we've sent already from our mapping.
+  wf->pos += n;
+  WaveformFile_advise(wf, wf->released_until, wf->pos, MADV_DONTNEED);
+  wf->released_until = wf->pos;
+  return n;
 }
 
 /* --------------------------------------------------------------------------
@@ -210,8 +963,8 @@ void initialize_gpio_for_output(volatile uint32_t *gpio_registerset, int bit) {
  */
 void run_cpu_direct() {
   // Prepare GPIO
-  volatile uint32_t *gpio_port = mmap_bcm_register(GPIO_REGISTER_BASE);
-  initialize_gpio_for_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
   volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
   volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
 
@@ -233,8 +986,8 @@ void run_cpu_direct() {
  */
 void run_cpu_from_memory_masked() {
   // Prepare GPIO
-  volatile uint32_t *gpio_port = mmap_bcm_register(GPIO_REGISTER_BASE);
-  initialize_gpio_for_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
   volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
   volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
 
@@ -269,8 +1022,8 @@ void run_cpu_from_memory_masked() {
  */
 void run_cpu_from_memory_set_reset() {
   // Prepare GPIO
-  volatile uint32_t *gpio_port = mmap_bcm_register(GPIO_REGISTER_BASE);
-  initialize_gpio_for_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
   volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
   volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
 
@@ -312,8 +1065,8 @@ void run_cpu_from_memory_set_reset() {
  */
 void run_cpu_from_uncached_memory_set_reset() {
   // Prepare GPIO
-  volatile uint32_t *gpio_port = mmap_bcm_register(GPIO_REGISTER_BASE);
-  initialize_gpio_for_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
   volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
   volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
 
@@ -327,7 +1080,7 @@ void run_cpu_from_uncached_memory_set_reset() {
   const int n = 256;
   struct GPIOData *gpio_data;
   struct UncachedMemBlock memblock
-    = UncachedMemBlock_alloc(n * sizeof(*gpio_data));
+    = alloc_block(n * sizeof(*gpio_data));
   gpio_data = (struct GPIOData*) memblock.mem;
   for (int i = 0; i < n; ++i) {
     gpio_data[i].set = (1<<TOGGLE_GPIO);
@@ -349,6 +1102,128 @@ void run_cpu_from_uncached_memory_set_reset() {
   UncachedMemBlock_free(&memblock); // (though never reached due to Ctrl-C)
 }
 
+/* --------------------------------------------------------------------------
+ * Specialized CPU output kernels.
+ *
+ * The loops above are generic: the compiler doesn't know the mask or how
+ * many records there are, so the masked variant tests each word twice and
+ * branches on the result, and each record costs a loop iteration. Here, the
+ * mask and the buffer length are compile-time constants, and the kernels are
+ * stamped out by macros with the loop unrolled into straight store sequences.
+ *
+ * A single pin in the mask needs exactly one write per word, to either set
+ * or clr; the register to write to is chosen with a conditional move instead
+ * of a branch. For more pins, both registers are written unconditionally;
+ * writing a zero to set or clr changes nothing.
+ *
+ * Ahead of the stores, PLD (__builtin_prefetch()) asks the memory system for
+ * the data a few cache lines ahead, so it arrives while we are busy writing
+ * to GPIO. The buffer length needs to be a multiple of CPU_KERNEL_UNROLL.
+ * --------------------------------------------------------------------------
+ */
+#define CPU_KERNEL_UNROLL         8
+#define CPU_KERNEL_CACHE_LINE     32    // Pi 1; the later ones have 64 bytes.
+#define CPU_KERNEL_PREFETCH_AHEAD (4 * CPU_KERNEL_CACHE_LINE)
+
+#define CPU_KERNEL_PLD(p) \
+  __builtin_prefetch((const char*)(p) + CPU_KERNEL_PREFETCH_AHEAD)
+
+// Write one word "v" expanded with the compile-time constant "mask".
+#define CPU_KERNEL_MASKED_WRITE(v, mask) do {                           \
+    const uint32_t value_ = (v);                                        \
+    if (((mask) & ((mask) - 1)) == 0) {                                 \
+      volatile uint32_t *reg_ = (value_ & (mask)) ? set_reg : clr_reg;  \
+      *reg_ = (mask);                                                   \
+    } else {                                                            \
+      *set_reg =  value_ & (mask);                                      \
+      *clr_reg = ~value_ & (mask);                                      \
+    }                                                                   \
+  } while (0)
+
+// Define "name", sending the "n" words at "data" masked with "mask".
+#define DEFINE_CPU_MASKED_KERNEL(name, mask, n)                         \
+  static void name(const uint32_t *data,                                \
+                   volatile uint32_t *set_reg,                          \
+                   volatile uint32_t *clr_reg) {                        \
+    for (const uint32_t *it = data; it < data + (n);                    \
+         it += CPU_KERNEL_UNROLL) {                                     \
+      CPU_KERNEL_PLD(it);                                               \
+      CPU_KERNEL_MASKED_WRITE(it[0], mask);                             \
+      CPU_KERNEL_MASKED_WRITE(it[1], mask);                             \
+      CPU_KERNEL_MASKED_WRITE(it[2], mask);                             \
+      CPU_KERNEL_MASKED_WRITE(it[3], mask);                             \
+      CPU_KERNEL_MASKED_WRITE(it[4], mask);                             \
+      CPU_KERNEL_MASKED_WRITE(it[5], mask);                             \
+      CPU_KERNEL_MASKED_WRITE(it[6], mask);                             \
+      CPU_KERNEL_MASKED_WRITE(it[7], mask);                             \
+    }                                                                   \
+  }
+
+// Define "name", sending the "n" pre-expanded records at "data". Eight
+// records are two cache lines on the Pi 1, so two PLD per round.
+#define DEFINE_CPU_SET_RESET_KERNEL(name, n)                            \
+  static void name(const struct GPIOSetClr *data,                       \
+                   volatile uint32_t *set_reg,                          \
+                   volatile uint32_t *clr_reg) {                        \
+    for (const struct GPIOSetClr *it = data; it < data + (n);           \
+         it += CPU_KERNEL_UNROLL) {                                     \
+      CPU_KERNEL_PLD(it);                                               \
+      CPU_KERNEL_PLD(it + 4);                                           \
+      *set_reg = it[0].set; *clr_reg = it[0].clr;                       \
+      *set_reg = it[1].set; *clr_reg = it[1].clr;                       \
+      *set_reg = it[2].set; *clr_reg = it[2].clr;                       \
+      *set_reg = it[3].set; *clr_reg = it[3].clr;                       \
+      *set_reg = it[4].set; *clr_reg = it[4].clr;                       \
+      *set_reg = it[5].set; *clr_reg = it[5].clr;                       \
+      *set_reg = it[6].set; *clr_reg = it[6].clr;                       \
+      *set_reg = it[7].set; *clr_reg = it[7].clr;                       \
+    }                                                                   \
+  }
+
+// The kernels for the 256 word buffers of the experiments 2 to 4, and for
+// the default parallel bus (same pins as kDefaultBusPins below).
+#define CPU_KERNEL_RECORDS 256
+#define DEFAULT_BUS_MASK ((1<<4)  | (1<<17) | (1<<18) | (1<<27) | \
+                          (1<<22) | (1<<23) | (1<<24) | (1<<25))
+DEFINE_CPU_MASKED_KERNEL(cpu_kernel_masked_toggle, (1<<TOGGLE_GPIO),
+                         CPU_KERNEL_RECORDS)
+DEFINE_CPU_MASKED_KERNEL(cpu_kernel_masked_bus, DEFAULT_BUS_MASK,
+                         CPU_KERNEL_RECORDS)
+DEFINE_CPU_SET_RESET_KERNEL(cpu_kernel_set_reset, CPU_KERNEL_RECORDS)
+
+// With -a, the experiments report the memory they use.
+static int report_memory = 0;
+
+// Report the footprint of an experiment that has its control blocks and
+// payload in one pool.
+static void report_pool_footprint(const char *name,
+                                  const struct UncachedMemPool *pool,
+                                  const struct UncachedMemBlock *cb_block,
+                                  const struct UncachedMemBlock *data_block,
+                                  int samples) {
+  if (!report_memory) return;
+  struct DMAFootprint fp;
+  fp.cb_bytes = cb_block->requested_size;
+  fp.payload_bytes = data_block->requested_size;
+  fp.locked_bytes = pool->block.size;
+  fp.samples = samples;
+  DMAFootprint_print(name, &fp);
+}
+
+static void report_stream_footprint(const char *name,
+                                    const struct DMAStream *stream) {
+  if (!report_memory) return;
+  struct DMAFootprint fp;
+  DMAStream_footprint(stream, &fp);
+  DMAFootprint_print(name, &fp);
+}
+
+static void report_memory_at_exit() {
+  struct UncachedMemStats stats;
+  UncachedMemBlock_get_stats(&stats);
+  UncachedMemStats_print(&stats);
+}
+
 /*
  * Writing data via DMA to GPIO. We do that in a 2D write with a stride that
  * skips the gap between the GPIO registers. Each of these GPIO operations
@@ -360,8 +1235,8 @@ void run_cpu_from_uncached_memory_set_reset() {
  */
 void run_dma_single_transfer_per_cb() {
   // Prepare GPIO
-  volatile uint32_t *gpio_port = mmap_bcm_register(GPIO_REGISTER_BASE);
-  initialize_gpio_for_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
 
   // Layout of our input data.
   struct GPIOData {
@@ -369,13 +1244,17 @@ void run_dma_single_transfer_per_cb() {
     uint32_t clr;
   };
 
+  // All the uncached memory we need: the data and the dma_cb are taken as
+  // separate chunks from one pool, so we only need a single allocation
+  // round-trip with the mailbox, and everything is nicely tight in memory.
+  struct UncachedMemPool pool = create_pool(GPIODMA_PAGE_SIZE);
+
   // Prepare data. This needs to be in uncached memory. We only set up
   // a single GPIOData because we'll be setting up the DMA controller into
-  // a loop (note, we can allocate one memblock for this and the dma_cb
-  // to keep everything nicely tight in memory, but let's separate this here
-  // for easier understanding).
+  // a loop.
   struct GPIOData *gpio_data;
-  struct UncachedMemBlock memblock = UncachedMemBlock_alloc(sizeof(*gpio_data));
+  struct UncachedMemBlock memblock
+    = UncachedMemPool_alloc(&pool, sizeof(*gpio_data));
   gpio_data = (struct GPIOData*) memblock.mem;
   gpio_data->set = (1<<TOGGLE_GPIO);
   gpio_data->clr = (1<<TOGGLE_GPIO);
@@ -385,7 +1264,7 @@ void run_dma_single_transfer_per_cb() {
   // Also, only UncachedMemBlock allows us to conveniently get the physical
   // address.
   struct UncachedMemBlock cb_memblock
-    = UncachedMemBlock_alloc(sizeof(struct dma_cb));
+    = UncachedMemPool_alloc(&pool, sizeof(struct dma_cb));
   struct dma_cb *cb = (struct dma_cb*) cb_memblock.mem;
   cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
                 DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_TDMODE);
@@ -402,13 +1281,16 @@ void run_dma_single_transfer_per_cb() {
   // Now set the 'next' block up, which it ourself. So essentially loop back.
   cb->next   = UncachedMemBlock_to_physical(&cb_memblock, cb);
 
+  report_pool_footprint("5)", &pool, &cb_memblock, &memblock, 1);
+
   printf("5) DMA: Single control block per set/reset GPIO\n"
-         "== Press <RETURN> to exit (with CTRL-C DMA keeps going).");
+         "== Press <RETURN> to exit.");
 
-  char *dmaBase = mmap_bcm_register(DMA_BASE);
-  // 4.2.1.2
-  struct dma_channel_header* channel
-    = (struct dma_channel_header*)(dmaBase + 0x100 * DMA_CHANNEL);
+  // Make sure all we wrote is visible to the DMA controller (see -m).
+  UncachedMemBlock_sync_for_dma(&pool.block);
+
+  volatile struct dma_channel_header *channel
+    = dma_channel_claim(choose_channel());
 
   channel->cs |= DMA_CS_END;
   channel->cblock = UncachedMemBlock_to_physical(&cb_memblock, cb);
@@ -426,8 +1308,9 @@ void run_dma_single_transfer_per_cb() {
   channel->cs &= ~DMA_CS_ACTIVE;
   channel->cs |= DMA_CS_RESET;
 
-  UncachedMemBlock_free(&memblock);
-  UncachedMemBlock_free(&cb_memblock);
+  UncachedMemPool_free(&pool, &memblock);
+  UncachedMemPool_free(&pool, &cb_memblock);
+  UncachedMemPool_destroy(&pool);
 }
 
 /*
@@ -444,8 +1327,8 @@ void run_dma_single_transfer_per_cb() {
  */
 void run_dma_multi_transfer_per_cb() {
   // Prepare GPIO
-  volatile uint32_t *gpio_port = mmap_bcm_register(GPIO_REGISTER_BASE);
-  initialize_gpio_for_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
 
   // Layout of our input data. It mimicks the same layout of the GPIO registers.
   // It covers an 'reserved' area between the set/clear registers, which we
@@ -458,11 +1341,14 @@ void run_dma_multi_transfer_per_cb() {
   };
 
   // Prepare data. This needs to be in uncached memory. We set up a bunch
-  // of data that we then send via DMA in a loop to GPIO.
+  // of data that we then send via DMA in a loop to GPIO. Data and dma_cb
+  // are chunks of one pool: a single allocation round-trip with the mailbox.
   const int n = 256;
   struct GPIOData *gpio_data;
+  struct UncachedMemPool pool
+    = create_pool(n * sizeof(*gpio_data) + sizeof(struct dma_cb));
   struct UncachedMemBlock memblock
-    = UncachedMemBlock_alloc(n * sizeof(*gpio_data));
+    = UncachedMemPool_alloc(&pool, n * sizeof(*gpio_data));
   gpio_data = (struct GPIOData*) memblock.mem;
   for (int i = 0; i < n; ++i) {
     gpio_data[i].set = (1<<TOGGLE_GPIO);
@@ -474,7 +1360,7 @@ void run_dma_multi_transfer_per_cb() {
   // Also, only UncachedMemBlock allows us to conveniently get the physical
   // address.
   struct UncachedMemBlock cb_memblock
-    = UncachedMemBlock_alloc(sizeof(struct dma_cb));
+    = UncachedMemPool_alloc(&pool, sizeof(struct dma_cb));
   struct dma_cb *cb = (struct dma_cb*) cb_memblock.mem;
   cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
                 DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_TDMODE);
@@ -493,14 +1379,17 @@ void run_dma_multi_transfer_per_cb() {
   // Now set the 'next' block up, which it ourself. So essentially loop back.
   cb->next   = UncachedMemBlock_to_physical(&cb_memblock, cb);
 
+  report_pool_footprint("6)", &pool, &cb_memblock, &memblock, n);
+
   printf("6) DMA: Sending a sequence of set/clear with one DMA control block "
          "and negative destination stride.\n"
-         "== Press <RETURN> to exit (with CTRL-C DMA keeps going).");
+         "== Press <RETURN> to exit.");
+
+  // Make sure all we wrote is visible to the DMA controller (see -m).
+  UncachedMemBlock_sync_for_dma(&pool.block);
 
-  char *dmaBase = mmap_bcm_register(DMA_BASE);
-  // 4.2.1.2
-  struct dma_channel_header* channel
-    = (struct dma_channel_header*)(dmaBase + 0x100 * DMA_CHANNEL);
+  volatile struct dma_channel_header *channel
+    = dma_channel_claim(choose_channel());
 
   channel->cs |= DMA_CS_END;
   channel->cblock = UncachedMemBlock_to_physical(&cb_memblock, cb);
@@ -518,49 +1407,2779 @@ void run_dma_multi_transfer_per_cb() {
   channel->cs &= ~DMA_CS_ACTIVE;
   channel->cs |= DMA_CS_RESET;
 
-  UncachedMemBlock_free(&memblock);
-  UncachedMemBlock_free(&cb_memblock);
+  UncachedMemPool_free(&pool, &memblock);
+  UncachedMemPool_free(&pool, &cb_memblock);
+  UncachedMemPool_destroy(&pool);
 }
 
-static int usage(const char *prog) {
-  fprintf(stderr, "Usage %s [1...6]\n", prog);
-  fprintf(stderr, "Give number of test operation as argument to %s\n", prog);
-  fprintf(stderr, "Test operation\n"
-          "== Baseline tests, using CPU directly ==\n"
-          "1 - CPU: Writing to GPIO directly in tight loop\n"
-          "2 - CPU: reading word from memory, write masked to GPIO set/clr.\n"
-          "3 - CPU: reading prepared set/clr from memory, write to GPIO.\n"
-          "4 - CPU: reading prepared set/clr from UNCACHED memory, write to GPIO.\n"
-          "\n== DMA tests, using DMA to pump data to ==\n"
-          "5 - DMA: Single control block per set/reset GPIO\n"
-          "6 - DMA: Sending a sequence of set/clear with one DMA control block and negative destination stride.\n");
-  fprintf(stderr, "Compiled for peripheral base 0x%08X\n", PERI_BASE);
-  return 1;
-}
+/*
+ * The same two experiments, 5 and 6, on the DMA4 engines of the BCM2711
+ * (Pi 4). These are the channels 11..14; they read memory in wider bursts
+ * and have a different control block layout: addresses are 40 bit, so each
+ * has an 'info' word holding the upper bits next to the increment, the
+ * transfer width and the 2D stride. Memory is given by its physical address
+ * and the peripherals are at 0x4_7Exx_xxxx. The control blocks themselves
+ * are given to the channel shifted right by 5 as they are 32 byte aligned.
+ *
+ * On a Pi 4, experiments 5 and 6 use this unless a legacy channel is
+ * requested with -c (0..6), so the two can be compared.
+ */
+void run_dma4_transfer(int experiment) {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    return usage(argv[0]);
+  // Experiment 5 sends one set/clr pair with a destination stride over
+  // the gap between the registers, 6 sends GPIORegData records that mimic
+  // the register layout and go back with a negative stride.
+  const int n = (experiment == 5) ? 1 : 256;
+  const size_t data_size = (experiment == 5)
+    ? 2 * sizeof(uint32_t) : n * sizeof(struct GPIORegData);
+  struct UncachedMemPool pool
+    = create_pool(UncachedMemPool_chunk_size(data_size) +
+                  UncachedMemPool_chunk_size(sizeof(struct dma4_cb)));
+  struct UncachedMemBlock memblock = UncachedMemPool_alloc(&pool, data_size);
+  struct UncachedMemBlock cb_memblock
+    = UncachedMemPool_alloc(&pool, sizeof(struct dma4_cb));
+
+  struct dma4_cb *cb = (struct dma4_cb*) cb_memblock.mem;
+  memset(cb, 0, sizeof(*cb));
+  cb->ti  = DMA4_TI_TDMODE | DMA4_TI_WAIT_RESP;
+  cb->src = GPIODMA_BUS_TO_PHYS(memblock.bus_addr);
+  cb->dst = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+  if (experiment == 5) {
+    uint32_t *gpio_data = (uint32_t*) memblock.mem;
+    gpio_data[0] = (1<<TOGGLE_GPIO);  // set
+    gpio_data[1] = (1<<TOGGLE_GPIO);  // clr
+    cb->srci   = DMA4_INFO_INC | DMA4_INFO_SIZE_32;
+    cb->dsti   = (DMA4_INFO_ADDR_HI(DMA4_PERI_ADDR_HI) | DMA4_INFO_INC |
+                  DMA4_INFO_SIZE_32 | DMA4_INFO_STRIDE(8));
+    cb->length = DMA4_LEN_YLENGTH(2) | DMA4_LEN_XLENGTH(4);
+  } else {
+    struct GPIORegData *gpio_data = (struct GPIORegData*) memblock.mem;
+    memset(gpio_data, 0, data_size);
+    for (int i = 0; i < n; ++i) {
+      gpio_data[i].set = (1<<TOGGLE_GPIO);
+      gpio_data[i].clr = (1<<TOGGLE_GPIO);
+    }
+    // The records are read 128 bit at a time, the registers written 32.
+    cb->srci   = DMA4_INFO_INC | DMA4_INFO_SIZE_128;
+    cb->dsti   = (DMA4_INFO_ADDR_HI(DMA4_PERI_ADDR_HI) | DMA4_INFO_INC |
+                  DMA4_INFO_SIZE_32 | DMA4_INFO_STRIDE(-16));
+    cb->length = DMA4_LEN_YLENGTH(n) | DMA4_LEN_XLENGTH(16);
   }
+  // Loop back to ourself.
+  cb->next = DMA4_CB_ADDR(GPIODMA_BUS_TO_PHYS(cb_memblock.bus_addr));
 
-  switch (atoi(argv[1])) {
-  case 1:
-    run_cpu_direct();
-    break;
-  case 2:
-    run_cpu_from_memory_masked();
-    break;
-  case 3:
+  char name[8];
+  snprintf(name, sizeof(name), "%d)", experiment);
+  report_pool_footprint(name, &pool, &cb_memblock, &memblock, n);
+
+  printf("%d) DMA4: %s\n"
+         "== Press <RETURN> to exit.", experiment,
+         (experiment == 5)
+         ? "Single control block per set/reset GPIO"
+         : "Sending a sequence of set/clear with one DMA4 control block "
+           "and negative destination stride.");
+
+  UncachedMemBlock_sync_for_dma(&pool.block);
+
+  volatile struct dma4_channel_header *channel
+    = dma4_channel_claim(choose_dma4_channel());
+  dma4_channel_start(channel, GPIODMA_BUS_TO_PHYS(cb_memblock.bus_addr));
+
+  // At this point, the DMA controller loops by itself, the CPU is free.
+  getchar();
+
+  dma4_channel_stop(channel);
+
+  UncachedMemPool_free(&pool, &memblock);
+  UncachedMemPool_free(&pool, &cb_memblock);
+  UncachedMemPool_destroy(&pool);
+}
+
+/*
+ * Changing the waveform of a running DMA loop, as in
+ * run_dma_multi_transfer_per_cb(), but without stopping the channel: every
+ * half second a square wave with a different period is committed to the
+ * DMALoop, which splices it in at the end of the current round.
+ */
+void run_dma_loop_swap() {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  const int n = 4096;
+  struct GPIORegData *records
+    = (struct GPIORegData*) calloc(n, sizeof(*records));
+  assert(records);
+  struct DMALoop loop;
+  exit_if(DMALoop_init(&loop, choose_channel(), n) != 0,
+          "Setting up the loop");
+  if (report_memory) {
+    struct DMAFootprint fp;
+    DMALoop_footprint(&loop, &fp);
+    DMAFootprint_print("22)", &fp);
+  }
+
+  printf("22) DMA: Changing the waveform on the fly by splicing in a new "
+         "control block chain.\n"
+         "== Press <RETURN> to exit.\n");
+  fflush(stdout);
+
+  int half_period = 1;  // In records.
+  for (int round = 0; /**/; ++round) {
+    // Square wave with the given half period; n is a multiple of all of
+    // them, so the loop is seamless.
+    for (int i = 0; i < n; ++i) {
+      const uint32_t level = ((i / half_period) % 2 == 0) ? (1<<TOGGLE_GPIO) : 0;
+      const struct GPIORegData record = { level, 0, 0, ~level & (1<<TOGGLE_GPIO) };
+      records[i] = record;
+    }
+
+    const uint32_t start = gpiodma_system_timer_usec();
+    if (round == 0) {
+      exit_if(DMALoop_start(&loop, records, n) != 0, "Starting the loop");
+    } else {
+      while (DMALoop_commit(&loop, records, n) != 0)
+        usleep(100);   // Previous change not through yet.
+      while (!DMALoop_switched(&loop))
+        usleep(100);
+      printf("Half period %4d records; switched after %6uusec\n",
+             half_period, gpiodma_system_timer_usec() - start);
+      fflush(stdout);
+    }
+    half_period = (half_period >= 64) ? 1 : 2 * half_period;
+
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(STDIN_FILENO, &read_fds);
+    struct timeval timeout = { 0, 500000 };
+    if (select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout) > 0)
+      break;  // User pressed <RETURN>.
+  }
+
+  DMALoop_free(&loop);
+  free(records);
+}
+
+/*
+ * Streaming data with DMA. Other than the previous DMA examples that loop
+ * over a fixed buffer, we use the DMAStream: a ring of two chunks, each with
+ * its own control block. While the DMA sends one chunk, the CPU refills the
+ * other with new data.
+ *
+ * To see that the data actually changes, we send a square wave whose period
+ * keeps getting longer, then starts over again.
+ */
+struct ChirpState {
+  int half_period;   // Current length of high or low phase in records.
+  int written;       // Records written in the current phase.
+  int level;         // Current output level.
+};
+
+static int fill_chirp(void *user_data, struct GPIORegData *data, int n) {
+  struct ChirpState *state = (struct ChirpState*) user_data;
+  for (int i = 0; i < n; ++i) {
+    // Build the full record locally, then write it in one go to the
+    // uncached memory.
+    struct GPIORegData record = {0, 0, 0, 0};
+    if (state->level)
+      record.set = (1<<TOGGLE_GPIO);
+    else
+      record.clr = (1<<TOGGLE_GPIO);
+    data[i] = record;
+
+    if (++state->written >= state->half_period) {
+      state->written = 0;
+      state->level = !state->level;
+      if (!state->level && ++state->half_period > 64)
+        state->half_period = 1;
+    }
+  }
+  return n;
+}
+
+void run_dma_stream() {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  struct ChirpState chirp = { 1, 0, 1 };
+  struct DMAStream stream;
+  exit_if(DMAStream_init(&stream, choose_channel(), 2, 4096,
+                         fill_chirp, &chirp) != 0,
+          "Setting up the stream");
+  report_stream_footprint("7)", &stream);
+
+  printf("7) DMA: Streaming ever changing data through a ring of control "
+         "blocks, CPU refilling the idle one.\n"
+         "== Press <RETURN> to exit.");
+  fflush(stdout);
+
+  DMAStream_start(&stream);
+
+  // Refill whenever the DMA is done with a chunk. Sending one chunk takes
+  // a couple of milliseconds, so checking every 500usec is plenty. The
+  // select() doubles as waiting for <RETURN>.
+  for (;;) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(STDIN_FILENO, &read_fds);
+    struct timeval timeout = { 0, 500 };
+    if (select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout) > 0)
+      break;  // User pressed <RETURN>.
+    if (DMAStream_refill(&stream) < 0)
+      break;  // Stream done.
+  }
+
+  DMAStream_free(&stream);
+}
+
+/*
+ * Rate control: with 23, the output of 8 reports the rate the DMA actually
+ * achieves, measured against the system timer. The PWM clock itself is
+ * steady, but the DMA might not keep up with it, e.g. when other bus masters
+ * compete for memory; then the PWM just waits and we are slower.
+ */
+#define RATE_WINDOW_USEC 1000000
+#define RATE_DRIFT_PPM   100     // Report as falling behind beyond that.
+
+static int fractional_pacing = 0;   // -x
+
+// Report the achieved rate every RATE_WINDOW_USEC until <RETURN>. Where the
+// channel is in the ring of "n" samples, two control blocks each, tells how
+// far it got; we need to look more often than it takes to go around.
+static void monitor_paced_rate(volatile struct dma_channel_header *channel,
+                               uint32_t cb_bus_addr, int n, double rate) {
+  struct RateMonitor monitor;
+  RateMonitor_init(&monitor, rate, RATE_WINDOW_USEC);
+  const uint32_t ring_usec = n * 1e6 / rate;
+  uint32_t last_pos = 0;
+  uint32_t last_usec = monitor.last_usec;
+  uint32_t late_polls = 0;
+  for (;;) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(STDIN_FILENO, &read_fds);
+    struct timeval timeout = { 0, 1000 };
+    if (select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout) > 0)
+      break;  // User pressed <RETURN>.
+
+    const uint32_t cblock = channel->cblock;
+    if (cblock < cb_bus_addr) continue;  // Between control blocks.
+    const uint32_t pos = (cblock - cb_bus_addr) / (2 * sizeof(struct dma_cb));
+    const uint32_t now = gpiodma_system_timer_usec();
+    if (now - last_usec >= ring_usec) ++late_polls;  // Might miss a round.
+    last_usec = now;
+    const uint32_t done = (pos + n - last_pos) % n;
+    last_pos = pos;
+    if (!RateMonitor_add(&monitor, done)) continue;
+
+    const double window_ppm = RateMonitor_ppm(&monitor, monitor.window_rate);
+    printf("%12.1f samples/s (%+8.1f ppm); since start %12.1f (%+8.1f ppm)%s",
+           monitor.window_rate, window_ppm,
+           monitor.rate, RateMonitor_ppm(&monitor, monitor.rate),
+           (window_ppm < -RATE_DRIFT_PPM) ? "; falling behind" : "");
+    if (late_polls) printf("; %u late polls, might be low", late_polls);
+    printf("\n");
+    fflush(stdout);
+    late_polls = 0;
+  }
+}
+
+/*
+ * DMA output paced by the PWM hardware. The previous DMA examples send data
+ * as fast as the DMA controller manages, which comes with quite some jitter.
+ * Here, each output sample is preceded by a control block that writes a word
+ * to the PWM FIFO and waits for the PWM to request data (DREQ) before doing
+ * so. The PWM consumes one FIFO word per sample period, so the GPIO writes
+ * are paced at exactly that rate.
+ *
+ * This needs two control blocks per sample: 80 bytes per output operation.
+ */
+void run_dma_pwm_paced(double sample_rate, int monitor) {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  // Layout of our input data, as in run_dma_multi_transfer_per_cb(), so that
+  // a sample is a 16 byte copy from set to clr register.
+  struct GPIOData {
+    uint32_t set;
+    uint32_t ignored_upper_set_bits; // bits 33..54 of GPIO. Not needed.
+    uint32_t reserved_area;          // gap between GPIO registers.
+    uint32_t clr;
+  };
+
+  // Each sample needs its data and two control blocks: waiting for the
+  // PWM and writing to GPIO. Plus a word of (arbitrary) data to feed the FIFO.
+  // When monitoring, a longer ring gives us more time to look.
+  const int n = monitor ? 4096 : 256;
+  const size_t data_size = n * sizeof(struct GPIOData) + sizeof(uint32_t);
+  const size_t cb_size = 2 * n * sizeof(struct dma_cb);
+  struct UncachedMemPool pool
+    = create_pool(UncachedMemPool_chunk_size(data_size) +
+                  UncachedMemPool_chunk_size(cb_size));
+  struct UncachedMemBlock memblock = UncachedMemPool_alloc(&pool, data_size);
+  struct UncachedMemBlock cb_memblock = UncachedMemPool_alloc(&pool, cb_size);
+
+  // Prepare data. Alternating samples set and clear the pin, so we
+  // get a square wave of half the sample rate.
+  struct GPIOData *gpio_data = (struct GPIOData*) memblock.mem;
+  uint32_t *fifo_word = (uint32_t*) (gpio_data + n);
+  for (int i = 0; i < n; ++i) {
+    if (i % 2 == 0)
+      gpio_data[i].set = (1<<TOGGLE_GPIO);
+    else
+      gpio_data[i].clr = (1<<TOGGLE_GPIO);
+  }
+
+  struct dma_cb *cbs = (struct dma_cb*) cb_memblock.mem;
+  for (int i = 0; i < n; ++i) {
+    // Wait for the PWM to request data, then feed it one word.
+    struct dma_cb *pace_cb = &cbs[2*i];
+    pace_cb->info   = (DMA_CB_TI_PERMAP(DMA_DREQ_PWM) | DMA_CB_TI_DEST_DREQ |
+                       DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP);
+    pace_cb->src    = UncachedMemBlock_to_physical(&memblock, fifo_word);
+    pace_cb->dst    = PHYSICAL_PWM_BUS + PWM_FIF1_OFFSET;
+    pace_cb->length = 4;
+    pace_cb->next   = UncachedMemBlock_to_physical(&cb_memblock, &cbs[2*i+1]);
+
+    // Then immediately write the sample data to GPIO set..clr.
+    struct dma_cb *data_cb = &cbs[2*i+1];
+    data_cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
+                       DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP);
+    data_cb->src    = UncachedMemBlock_to_physical(&memblock, &gpio_data[i]);
+    data_cb->dst    = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+    data_cb->length = sizeof(struct GPIOData);
+    data_cb->next   = UncachedMemBlock_to_physical(&cb_memblock,
+                                                   &cbs[(2*i+2) % (2*n)]);
+  }
+
+  const int experiment = monitor ? 23 : 8;
+  char name[8];
+  snprintf(name, sizeof(name), "%d)", experiment);
+  report_pool_footprint(name, &pool, &cb_memblock, &memblock, n);
+  const struct PacingClock clock
+    = pacing_clock_plan(sample_rate, fractional_pacing);
+  const double achieved_rate = pwm_pacing_start_clock(&clock);
+  printf("%d) DMA: Sending set/clear paced by PWM at %.1f samples/s "
+         "(requested %.1f).\n", experiment, achieved_rate, sample_rate);
+  if (monitor) {
+    printf("PLLD %u Hz / (%u + %u/4096) / range %u: %.3f samples/s, "
+           "%+.1f ppm off the request.\n",
+           board->plld_freq, clock.divi, clock.divf, clock.range,
+           clock.rate, (clock.rate / sample_rate - 1.0) * 1e6);
+  }
+  printf("== Press <RETURN> to exit.%s", monitor ? "\n" : "");
+  fflush(stdout);
+
+  UncachedMemBlock_sync_for_dma(&pool.block);
+  volatile struct dma_channel_header *channel
+    = dma_channel_claim(choose_channel());
+  dma_channel_start(channel, UncachedMemBlock_to_physical(&cb_memblock, cbs));
+
+  // At this point, the DMA controller loops by itself, the CPU is free.
+  if (monitor)
+    monitor_paced_rate(channel, cb_memblock.bus_addr, n, achieved_rate);
+  else
+    getchar();
+
+  dma_channel_stop(channel);
+  pwm_pacing_stop();
+
+  UncachedMemPool_free(&pool, &memblock);
+  UncachedMemPool_free(&pool, &cb_memblock);
+  UncachedMemPool_destroy(&pool);
+}
+
+/*
+ * Output to a parallel bus of several GPIO pins. A counter is expanded
+ * with the lookup table of the ParallelBus into set/clr words, which are
+ * then written just like in run_cpu_from_memory_set_reset(); the hot loop
+ * does not need to do any bit operations.
+ */
+// Pins of the default 8 bit bus: the ones free on the Pi header by default.
+static const int kDefaultBusPins[] = { 4, 17, 18, 27, 22, 23, 24, 25 };
+
+// Fill "data" with the expanded values of a counter running through all
+// values of the bus. Returns the number of values.
+static int prepare_parallel_bus_counter(const struct ParallelBus *bus,
+                                        struct GPIOSetClr **data) {
+  const int n = 1 << bus->width;
+  *data = (struct GPIOSetClr*) malloc(n * sizeof(**data));
+  if (bus->width <= 8) {
+    uint8_t *samples = (uint8_t*) malloc(n);
+    for (int i = 0; i < n; ++i) {
+      samples[i] = i;
+    }
+    ParallelBus_expand_bytes(bus, samples, n, *data);
+    free(samples);
+  } else {
+    uint16_t *samples = (uint16_t*) malloc(n * sizeof(*samples));
+    for (int i = 0; i < n; ++i) {
+      samples[i] = i;
+    }
+    ParallelBus_expand(bus, samples, n, *data);
+    free(samples);
+  }
+  return n;
+}
+
+void run_cpu_parallel_bus(const int *pins, int width) {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  for (int i = 0; i < width; ++i) {
+    gpiodma_gpio_init_output(gpio_port, pins[i]);
+  }
+  volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
+  volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
+
+  // Prepare data.
+  struct ParallelBus bus;
+  ParallelBus_init(&bus, pins, width);
+  struct GPIOSetClr *gpio_data;
+  const int n = prepare_parallel_bus_counter(&bus, &gpio_data);
+
+  // Do it. Endless loop: reading, writing.
+  printf("9) CPU: %d bit counter on parallel bus, expanded with lookup table.\n"
+         "== Press Ctrl-C to exit.\n", width);
+  const struct GPIOSetClr *start = gpio_data;
+  const struct GPIOSetClr *end = start + n;
+  for (;;) {
+    for (const struct GPIOSetClr *it = start; it < end; ++it) {
+      *set_reg = it->set;
+      *clr_reg = it->clr;
+    }
+  }
+
+  free(gpio_data);  // (though never reached due to Ctrl-C)
+}
+
+/*
+ * The same parallel bus counter, but sent with DMA. The samples are
+ * expanded straight into the DMA records of a DMAStream whenever a chunk
+ * is to be refilled.
+ */
+struct BusCounterState {
+  const struct ParallelBus *bus;
+  uint16_t value;
+  uint16_t samples[4096];   // Scratch space for one chunk of samples.
+};
+
+static int fill_bus_counter(void *user_data, struct GPIORegData *data, int n) {
+  struct BusCounterState *state = (struct BusCounterState*) user_data;
+  const uint16_t value_mask = (1 << state->bus->width) - 1;
+  int done = 0;
+  while (done < n) {
+    const int batch = (n - done) > 4096 ? 4096 : (n - done);
+    for (int i = 0; i < batch; ++i) {
+      state->samples[i] = state->value++ & value_mask;
+    }
+    ParallelBus_expand_regdata(state->bus, state->samples, batch,
+                               data + done);
+    done += batch;
+  }
+  return n;
+}
+
+void run_dma_parallel_bus(const int *pins, int width) {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  for (int i = 0; i < width; ++i) {
+    gpiodma_gpio_init_output(gpio_port, pins[i]);
+  }
+
+  struct ParallelBus bus;
+  ParallelBus_init(&bus, pins, width);
+  struct BusCounterState counter;
+  counter.bus = &bus;
+  counter.value = 0;
+
+  struct DMAStream stream;
+  exit_if(DMAStream_init(&stream, choose_channel(), 2, 4096,
+                         fill_bus_counter, &counter) != 0,
+          "Setting up the stream");
+  report_stream_footprint("10)", &stream);
+
+  printf("10) DMA: %d bit counter on parallel bus, streamed.\n"
+         "== Press <RETURN> to exit.", width);
+  fflush(stdout);
+
+  DMAStream_start(&stream);
+  for (;;) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(STDIN_FILENO, &read_fds);
+    struct timeval timeout = { 0, 500 };
+    if (select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout) > 0)
+      break;  // User pressed <RETURN>.
+    DMAStream_refill(&stream);
+  }
+
+  DMAStream_free(&stream);
+}
+
+/*
+ * Compile a sparse waveform into a chain of control blocks, paced by PWM:
+ * a servo-like pulse of 1.5ms every 20ms, followed by a short burst.
+ * Sent as one sample per tick as in run_dma_pwm_paced(), this would need
+ * thousands of control blocks; compiled, it only needs a handful.
+ */
+void run_dma_compiled_waveform(double sample_rate) {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  if (sample_rate < 20000) {
+    fprintf(stderr, "This example needs a sample rate of at least 20000.\n");
+    return;
+  }
+  const double achieved_rate = pwm_pacing_start(sample_rate);
+  const uint32_t ms = (uint32_t)(achieved_rate / 1000 + 0.5);  // ticks per ms
+  const uint32_t on = (1<<TOGGLE_GPIO);
+  const struct WaveformEvent events[] = {
+    { on, 1 * ms }, { on, ms / 2 },      // Merged into one 1.5ms run.
+    { 0, 18 * ms },
+    { on, 1 }, { 0, 1 }, { on, 1 }, { 0, 1 }, { on, 1 }, { 0, 1 },
+    { 0, 20 * ms - (ms + ms / 2 + 18 * ms + 6) },  // Rest of the 20ms.
+  };
+  const int num_events = sizeof(events) / sizeof(events[0]);
+
+  struct UncachedMemPool pool = create_pool(GPIODMA_PAGE_SIZE);
+  struct CompiledWaveform waveform;
+  if (compile_waveform(&pool, events, num_events, on, 1, 1, &waveform) != 0) {
+    fprintf(stderr, "Can't compile waveform.\n");
+    pwm_pacing_stop();
+    UncachedMemPool_destroy(&pool);
+    return;
+  }
+  uint32_t period_ticks = 0;
+  for (int i = 0; i < num_events; ++i) period_ticks += events[i].ticks;
+  report_pool_footprint("11)", &pool, &waveform.cb_block, &waveform.data_block,
+                        period_ticks);
+
+  printf("11) DMA: Compiled waveform at %.1f ticks/s: %d events in "
+         "%d control blocks and %d records (%d bytes).\n"
+         "== Press <RETURN> to exit.",
+         achieved_rate, num_events, waveform.num_cbs, waveform.num_records,
+         (int)(waveform.num_cbs * sizeof(struct dma_cb) +
+               waveform.num_records * sizeof(struct GPIORegData)));
+
+  UncachedMemBlock_sync_for_dma(&pool.block);
+  volatile struct dma_channel_header *channel
+    = dma_channel_claim(choose_channel());
+  dma_channel_start(channel, waveform.cb_block.bus_addr);
+
+  // At this point, the DMA controller loops by itself, the CPU is free.
+  getchar();
+
+  dma_channel_stop(channel);
+  pwm_pacing_stop();
+  CompiledWaveform_free(&pool, &waveform);
+  UncachedMemPool_destroy(&pool);
+}
+
+/*
+ * Send a long buffer: 4 MByte worth of records, which is more than a single
+ * control block can describe. gpiodma_build_record_chain() splits it into
+ * the least number of control blocks, each with the maximum YLENGTH.
+ * The data is a square wave with its period slowly changing over the buffer,
+ * so that it doesn't repeat before the end.
+ */
+void run_dma_long_buffer() {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  const int n = 262144;
+  const int num_cbs = gpiodma_record_chain_length(n);
+  const size_t data_size = n * sizeof(struct GPIORegData);
+  const size_t cb_size = num_cbs * sizeof(struct dma_cb);
+  struct UncachedMemPool pool
+    = create_pool(UncachedMemPool_chunk_size(data_size) +
+                  UncachedMemPool_chunk_size(cb_size));
+  struct UncachedMemBlock memblock = UncachedMemPool_alloc(&pool, data_size);
+  struct UncachedMemBlock cb_memblock = UncachedMemPool_alloc(&pool, cb_size);
+  assert(memblock.mem && cb_memblock.mem);
+
+  // Prepare the levels in cached memory and encode them in one go.
+  uint32_t *levels = (uint32_t*) malloc(n * sizeof(*levels));
+  int half_period = 1, phase = 0, level = 1;
+  for (int i = 0; i < n; ++i) {
+    levels[i] = level ? (1<<TOGGLE_GPIO) : 0;
+    if (++phase >= half_period) {
+      phase = 0;
+      level = !level;
+      if (!level && ++half_period > 256) half_period = 1;
+    }
+  }
+  struct GPIORegData *gpio_data = (struct GPIORegData*) memblock.mem;
+  gpiodma_encode_records(levels, n, (1<<TOGGLE_GPIO), gpio_data);
+  free(levels);
+
+  struct dma_cb *cbs = (struct dma_cb*) cb_memblock.mem;
+  gpiodma_build_record_chain(&cb_memblock, cbs, &memblock, gpio_data, n,
+                             cb_memblock.bus_addr);  // loop back to start.
+  report_pool_footprint("12)", &pool, &cb_memblock, &memblock, n);
+
+  printf("12) DMA: Sending %d records (%d bytes) with %d control blocks.\n"
+         "== Press <RETURN> to exit.",
+         n, (int)data_size, num_cbs);
+
+  UncachedMemBlock_sync_for_dma(&pool.block);
+  volatile struct dma_channel_header *channel
+    = dma_channel_claim(choose_channel());
+  dma_channel_start(channel, cb_memblock.bus_addr);
+
+  // At this point, the DMA controller loops by itself, the CPU is free.
+  getchar();
+
+  dma_channel_stop(channel);
+  UncachedMemPool_free(&pool, &memblock);
+  UncachedMemPool_free(&pool, &cb_memblock);
+  UncachedMemPool_destroy(&pool);
+}
+
+/*
+ * A long waveform, run-length encoded and decoded into control blocks just
+ * in time: a servo signal slowly sweeping the pulse from 1ms to 2ms and back,
+ * paced by the PWM.
+ */
+void run_dma_rle_waveform(double sample_rate) {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  if (sample_rate < 20000) {
+    fprintf(stderr, "This example needs a sample rate of at least 20000.\n");
+    return;
+  }
+  const double achieved_rate = pwm_pacing_start(sample_rate);
+  const uint32_t ms = (uint32_t)(achieved_rate / 1000 + 0.5);  // ticks per ms
+  const uint32_t on = (1<<TOGGLE_GPIO);
+
+  // 20ms periods; 250 up, 250 down.
+  const int periods = 500;
+  struct WaveformEvent *events
+    = (struct WaveformEvent*) malloc(2 * periods * sizeof(*events));
+  uint64_t total_ticks = 0;
+  for (int p = 0; p < periods; ++p) {
+    const int step = p < periods / 2 ? p : periods - 1 - p;
+    const uint32_t pulse = ms + (uint64_t)ms * step / (periods / 2 - 1);
+    events[2*p].levels = on;
+    events[2*p].ticks = pulse;
+    events[2*p+1].levels = 0;
+    events[2*p+1].ticks = 20 * ms - pulse;
+    total_ticks += 20 * ms;
+  }
+  uint8_t *encoded = (uint8_t*) malloc(2 * periods * 10);
+  struct RleDecoder decoder;
+  memset(&decoder, 0, sizeof(decoder));
+  decoder.data = encoded;
+  decoder.size = rle_encode(events, 2 * periods, on, encoded);
+  decoder.loop = 1;
+  free(events);
+
+  struct RleStream stream;
+  RleStream_init(&stream, choose_channel(), &decoder, on, 1, 64);
+  if (report_memory) {
+    struct DMAFootprint fp;
+    RleStream_footprint(&stream, total_ticks * 64 / (2 * periods), &fp);
+    DMAFootprint_print("16)", &fp);
+  }
+
+  printf("16) DMA: Run-length encoded servo sweep at %.1f ticks/s: %d bytes "
+         "encoded instead of %llu bytes of records.\n"
+         "== Press <RETURN> to exit.",
+         achieved_rate, (int)decoder.size,
+         (unsigned long long)(total_ticks * sizeof(struct GPIORegData)));
+  fflush(stdout);
+
+  RleStream_start(&stream);
+  for (;;) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(STDIN_FILENO, &read_fds);
+    struct timeval timeout = { 0, 500 };
+    if (select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout) > 0)
+      break;  // User pressed <RETURN>.
+    if (RleStream_refill(&stream) < 0)
+      break;  // Waveform done (never, as it loops).
+  }
+
+  RleStream_free(&stream);
+  pwm_pacing_stop();
+  free(encoded);
+}
+
+/*
+ * An application thread producing the output: here it is the main thread
+ * pushing a square wave into the DMAFeeder queue, while the refill thread
+ * moves it on into the DMA chunks. Once a second, we report how much of the
+ * output the producer could not deliver in time.
+ */
+void run_dma_queue_feed() {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  struct DMAFeeder feeder;
+  DMAFeeder_start(&feeder, choose_channel(), 4, 4096, 1 << 16);
+  report_stream_footprint("14)", &feeder.stream);
+
+  printf("14) DMA: Producer thread feeding the DMA stream through a lock-free "
+         "queue.\n== Press <RETURN> to exit.\n");
+  fflush(stdout);
+
+  struct GPIORegData frame[256];
+  memset(frame, 0x00, sizeof(frame));
+  for (int i = 0; i < 256; ++i) {
+    if (i % 2 == 0)
+      frame[i].set = (1<<TOGGLE_GPIO);
+    else
+      frame[i].clr = (1<<TOGGLE_GPIO);
+  }
+
+  int pushed = 0;            // Records of the current frame pushed already.
+  uint64_t total_pushed = 0;
+  uint32_t last_report = gpiodma_system_timer_usec();
+  for (;;) {
+    const int n = SampleQueue_push(&feeder.queue, frame + pushed, 256 - pushed);
+    pushed = (pushed + n) % 256;
+    total_pushed += n;
+    if (n == 0) {
+      // Queue full; a real application would do something useful here.
+      // Check if the user wants to quit.
+      fd_set read_fds;
+      FD_ZERO(&read_fds);
+      FD_SET(STDIN_FILENO, &read_fds);
+      struct timeval timeout = { 0, 100 };
+      if (select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout) > 0)
+        break;
+    }
+
+    const uint32_t now = gpiodma_system_timer_usec();
+    if (now - last_report >= 1000000) {
+      printf("%10.0f records/s; underruns: %u chunks, %u records\n",
+             total_pushed * 1e6 / (now - last_report),
+             __atomic_load_n(&feeder.underruns, __ATOMIC_RELAXED),
+             __atomic_load_n(&feeder.missing_records, __ATOMIC_RELAXED));
+      total_pushed = 0;
+      last_report = now;
+    }
+  }
+
+  SampleQueue_close(&feeder.queue);
+  DMAFeeder_free(&feeder);
+}
+
+/*
+ * Playing a waveform file with the DMAStream. If the file does not exist
+ * yet, a demo file with the chirp of run_dma_stream() is written first.
+ */
+void run_dma_waveform_file(const char *filename) {
+  if (access(filename, F_OK) != 0) {
+    const int n = 1 << 20;
+    struct GPIOSetClr *records = (struct GPIOSetClr*) malloc(n * sizeof(*records));
+    struct GPIORegData chunk[256];
+    struct ChirpState chirp = { 1, 0, 1 };
+    for (int done = 0; done < n; done += 256) {
+      fill_chirp(&chirp, chunk, 256);
+      for (int i = 0; i < 256; ++i) {
+        records[done + i].set = chunk[i].set;
+        records[done + i].clr = chunk[i].clr;
+      }
+    }
+    const int err = write_waveform_file(filename, records, n);
+    free(records);
+    if (err != 0) return;
+    printf("Wrote demo waveform with %d records to %s\n", n, filename);
+  }
+
+  struct WaveformFile wf;
+  if (WaveformFile_open(&wf, filename) != 0) return;
+
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  struct DMAStream stream;
+  exit_if(DMAStream_init(&stream, choose_channel(), 4, 4096,
+                         fill_from_waveform_file, &wf) != 0,
+          "Setting up the stream");
+  report_stream_footprint("15)", &stream);
+
+  printf("15) DMA: Playing %llu records from waveform file %s\n"
+         "== Press <RETURN> to stop.",
+         (unsigned long long)wf.num_records, filename);
+  fflush(stdout);
+
+  const uint32_t start_time = gpiodma_system_timer_usec();
+  DMAStream_start(&stream);
+  for (;;) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(STDIN_FILENO, &read_fds);
+    struct timeval timeout = { 0, 500 };
+    if (select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout) > 0)
+      break;  // User pressed <RETURN>.
+    if (DMAStream_refill(&stream) < 0)
+      break;  // Whole file sent.
+  }
+  const uint32_t elapsed = gpiodma_system_timer_usec() - start_time;
+  printf("\nSent %llu records in %.3f seconds.\n",
+         (unsigned long long)wf.pos, elapsed / 1e6);
+
+  DMAStream_free(&stream);
+  WaveformFile_close(&wf);
+}
+
+// What the logic analyzer found in the samples so far.
+struct CaptureStats {
+  uint64_t samples;
+  int have_last;               // last_* are valid.
+  uint32_t last_levels;
+  uint32_t last_usec;
+  uint32_t max_interval;       // Longest time between two samples.
+  uint32_t changes[32];        // Level changes per GPIO.
+};
+
+static void count_changes(void *user_data,
+                          const struct DMACaptureSample *samples, int n) {
+  struct CaptureStats *stats = (struct CaptureStats*) user_data;
+  for (int i = 0; i < n; ++i) {
+    const struct DMACaptureSample sample = samples[i];  // One uncached read.
+    if (stats->have_last) {
+      uint32_t changed = sample.levels ^ stats->last_levels;
+      while (changed) {
+        const int bit = __builtin_ctz(changed);
+        ++stats->changes[bit];
+        changed &= changed - 1;
+      }
+      if (sample.usec - stats->last_usec > stats->max_interval)
+        stats->max_interval = sample.usec - stats->last_usec;
+    }
+    stats->last_levels = sample.levels;
+    stats->last_usec = sample.usec;
+    stats->have_last = 1;
+    ++stats->samples;
+  }
+}
+
+/*
+ * A simple logic analyzer: the DMACapture samples the inputs of GPIO 0..31
+ * into a ring, paced by the PWM. Every 10 milliseconds, the CPU drains what
+ * the DMA captured and counts the level changes per GPIO; otherwise it is
+ * free. Once a second, we report the GPIOs that changed.
+ */
+void run_dma_capture(double sample_rate) {
+  struct DMACapture capture;
+  exit_if(DMACapture_init(&capture, choose_channel(), 32768, 1) != 0,
+          "Setting up the capture");
+  if (report_memory) {
+    struct DMAFootprint fp;
+    DMACapture_footprint(&capture, &fp);
+    DMAFootprint_print("20)", &fp);
+  }
+  const double achieved_rate = DMACapture_start(&capture, sample_rate);
+  printf("20) DMA: Capturing GPIO 0..31 paced by PWM at %.1f samples/s "
+         "(requested %.1f).\n"
+         "== Press <RETURN> to exit.\n",
+         achieved_rate, sample_rate);
+  fflush(stdout);
+
+  struct CaptureStats stats;
+  memset(&stats, 0, sizeof(stats));
+  uint32_t last_report = gpiodma_system_timer_usec();
+  for (;;) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(STDIN_FILENO, &read_fds);
+    struct timeval timeout = { 0, 10000 };
+    if (select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout) > 0)
+      break;  // User pressed <RETURN>.
+    DMACapture_drain(&capture, count_changes, &stats);
+
+    const uint32_t now = gpiodma_system_timer_usec();
+    if (now - last_report >= 1000000) {
+      printf("%10.0f samples/s, max interval %uusec, overruns %u; changes:",
+             stats.samples * 1e6 / (now - last_report), stats.max_interval,
+             capture.overruns);
+      for (int gpio = 0; gpio < 32; ++gpio) {
+        if (stats.changes[gpio]) printf(" GPIO%d=%u", gpio, stats.changes[gpio]);
+      }
+      printf("\n");
+      fflush(stdout);
+      const uint32_t levels = stats.last_levels;
+      const uint32_t usec = stats.last_usec;
+      memset(&stats, 0, sizeof(stats));
+      stats.have_last = 1;   // Keep comparing to the last sample.
+      stats.last_levels = levels;
+      stats.last_usec = usec;
+      last_report = now;
+    }
+  }
+
+  DMACapture_free(&capture);
+}
+
+/* --------------------------------------------------------------------------
+ * Daemon mode.
+ *
+ * Every run of the program allocates VC memory, maps the peripherals and
+ * sets up a DMA channel, which short-lived jobs pay for again and again; and
+ * allocating and freeing contiguous memory all the time fragments it. With
+ * -d, the program stays resident instead: it does all that once and then
+ * plays the waveforms clients send over a Unix socket.
+ *
+ * A job is the content of a waveform file: the WaveformFileHeader, followed
+ * by the records. The daemon replies with a DaemonReply once the waveform
+ * has been sent completely. Jobs are played one after another.
+ *
+ * The daemon runs as root, so it is careful about what it takes: the socket
+ * is only accessible to its user and group, which is checked again for each
+ * client; a waveform may only use the pins it was started with; and a client
+ * that stops sending is cut off, so it doesn't block everyone else.
+ * --------------------------------------------------------------------------
+ */
+#define DAEMON_MAX_RECORDS (256 * 1024)   // 4 MByte of VC memory.
+#define DAEMON_TIMEOUT_SEC 5              // Client may pause this long.
+
+struct DaemonReply {
+  int32_t status;      // 0: ok; < 0: error, see below.
+  uint32_t usec;       // Time it took to send the waveform.
+};
+#define DAEMON_ERR_HEADER   -1  // Not a waveform.
+#define DAEMON_ERR_TOO_LONG -2  // More than DAEMON_MAX_RECORDS records.
+#define DAEMON_ERR_SHORT    -3  // Closed or timed out before all records came.
+#define DAEMON_ERR_PINS     -4  // Uses pins the daemon wasn't started with.
+
+static int read_fully(int fd, void *buf, size_t len) {
+  for (uint8_t *pos = (uint8_t*) buf; len > 0; /**/) {
+    const ssize_t r = read(fd, pos, len);
+    if (r <= 0) return -1;
+    pos += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int write_fully(int fd, const void *buf, size_t len) {
+  for (const uint8_t *pos = (const uint8_t*) buf; len > 0; /**/) {
+    const ssize_t w = write(fd, pos, len);
+    if (w <= 0) return -1;
+    pos += w;
+    len -= w;
+  }
+  return 0;
+}
+
+static int unix_socket_address(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+// Everything the daemon keeps alive between jobs.
+struct GPIODaemon {
+  uint32_t allowed_pins;
+  volatile uint32_t *gpio_port;
+  volatile struct dma_channel_header *channel;
+  struct UncachedMemPool pool;
+  struct UncachedMemBlock cb_block;
+  struct UncachedMemBlock data_block;
+};
+
+// Receive one job from the client and play it.
+static struct DaemonReply GPIODaemon_serve(struct GPIODaemon *daemon,
+                                           int client) {
+  struct DaemonReply reply = { 0, 0 };
+  struct WaveformFileHeader header;
+  if (read_fully(client, &header, sizeof(header)) != 0) {
+    reply.status = DAEMON_ERR_SHORT;
+    return reply;
+  }
+  if (memcmp(header.magic, WAVEFORM_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.record_size != sizeof(struct GPIOSetClr)) {
+    reply.status = DAEMON_ERR_HEADER;
+    return reply;
+  }
+  if (header.num_records > DAEMON_MAX_RECORDS) {
+    reply.status = DAEMON_ERR_TOO_LONG;
+    return reply;
+  }
+  const int n = header.num_records;
+  if (n == 0) return reply;
+
+  // Expand straight into the DMA memory as it comes in.
+  struct GPIORegData *records = (struct GPIORegData*) daemon->data_block.mem;
+  struct GPIOSetClr buffer[256];
+  uint32_t used_pins = 0;
+  for (int done = 0; done < n; /**/) {
+    const int count = (n - done) > 256 ? 256 : (n - done);
+    if (read_fully(client, buffer, count * sizeof(buffer[0])) != 0) {
+      reply.status = DAEMON_ERR_SHORT;
+      return reply;
+    }
+    for (int i = 0; i < count; ++i) {
+      const struct GPIORegData record = { buffer[i].set, 0, 0, buffer[i].clr };
+      records[done + i] = record;
+      used_pins |= buffer[i].set | buffer[i].clr;
+    }
+    done += count;
+  }
+
+  // Make sure all pins the waveform uses are outputs; but leave any others
+  // alone, they might be UART, I2C or SPI.
+  if (used_pins & ~daemon->allowed_pins) {
+    reply.status = DAEMON_ERR_PINS;
+    return reply;
+  }
+  for (int pin = 0; pin < 32; ++pin) {
+    if (used_pins & (1u << pin))
+      gpiodma_gpio_init_output(daemon->gpio_port, pin);
+  }
+
+  struct dma_cb *cbs = (struct dma_cb*) daemon->cb_block.mem;
+  gpiodma_build_record_chain(&daemon->cb_block, cbs, &daemon->data_block,
+                             records, n, 0);
+  gpiodma_sync_for_dma(daemon->data_block.mem, n * sizeof(struct GPIORegData));
+  gpiodma_sync_for_dma(cbs,
+                       gpiodma_record_chain_length(n) * sizeof(struct dma_cb));
+
+  const uint32_t start_time = gpiodma_system_timer_usec();
+  dma_channel_start(daemon->channel, daemon->cb_block.bus_addr);
+  while (daemon->channel->cs & DMA_CS_ACTIVE) {
+    usleep(100);
+  }
+  reply.usec = gpiodma_system_timer_usec() - start_time;
+  return reply;
+}
+
+// Only our own user, root and members of our group may send waveforms; the
+// socket permissions say so, too, but they depend on the directory it is in.
+static int daemon_client_allowed(int client) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return 0;
+  if (cred.uid == 0 || cred.uid == geteuid() || cred.gid == getegid())
+    return 1;
+  const struct passwd *pw = getpwuid(cred.uid);
+  if (pw == NULL) return 0;
+  gid_t groups[64];
+  int num_groups = sizeof(groups) / sizeof(groups[0]);
+  if (getgrouplist(pw->pw_name, pw->pw_gid, groups, &num_groups) < 0)
+    return 0;  // In too many groups to tell.
+  for (int i = 0; i < num_groups; ++i) {
+    if (groups[i] == getegid()) return 1;
+  }
+  return 0;
+}
+
+// Play waveforms sent to the socket; they may only use "allowed_pins".
+static int run_daemon(const char *socket_path, uint32_t allowed_pins) {
+  struct sockaddr_un addr;
+  if (unix_socket_address(socket_path, &addr) != 0) return 1;
+
+  // All the memory we are ever going to need, allocated once.
+  struct GPIODaemon state;
+  state.allowed_pins = allowed_pins;
+  state.gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  exit_if(state.gpio_port == NULL, "Mapping the GPIO registers");
+  const size_t cb_size
+    = gpiodma_record_chain_length(DAEMON_MAX_RECORDS) * sizeof(struct dma_cb);
+  const size_t data_size = DAEMON_MAX_RECORDS * sizeof(struct GPIORegData);
+  state.pool = create_pool(UncachedMemPool_chunk_size(cb_size) +
+                           UncachedMemPool_chunk_size(data_size));
+  state.cb_block = UncachedMemPool_alloc(&state.pool, cb_size);
+  state.data_block = UncachedMemPool_alloc(&state.pool, data_size);
+  exit_if(!state.cb_block.mem || !state.data_block.mem,
+          "Allocating uncached memory");
+  report_pool_footprint("Daemon", &state.pool, &state.cb_block,
+                        &state.data_block, DAEMON_MAX_RECORDS);
+  state.channel = dma_channel_claim(choose_channel());
+
+  // A client going away early must not take us down with it.
+  signal(SIGPIPE, SIG_IGN);
+
+  const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path);  // Left over from a previous run.
+  const mode_t old_umask = umask(0117);  // Socket: rw for user and group.
+  const int bound = (server >= 0 &&
+                     bind(server, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  umask(old_umask);
+  if (!bound || listen(server, 8) != 0) {
+    perror(socket_path);
+    return 1;
+  }
+  printf("Daemon: waiting for waveforms on %s (up to %d records each, "
+         "pins 0x%08x).\n== Press Ctrl-C to exit.\n",
+         socket_path, DAEMON_MAX_RECORDS, allowed_pins);
+  fflush(stdout);
+
+  const struct timeval timeout = { DAEMON_TIMEOUT_SEC, 0 };
+  for (;;) {
+    const int client = accept(server, NULL, NULL);
+    if (client < 0) continue;
+    if (!daemon_client_allowed(client)) {
+      fprintf(stderr, "Daemon: rejected client of another user.\n");
+      close(client);
+      continue;
+    }
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    const struct DaemonReply reply = GPIODaemon_serve(&state, client);
+    write_fully(client, &reply, sizeof(reply));
+    close(client);
+  }
+  return 0;  // (though never reached due to Ctrl-C)
+}
+
+static const char *daemon_error_text(int32_t status) {
+  switch (status) {
+  case DAEMON_ERR_HEADER:   return "not a waveform";
+  case DAEMON_ERR_TOO_LONG: return "too many records";
+  case DAEMON_ERR_SHORT:    return "incomplete or too slow";
+  case DAEMON_ERR_PINS:     return "uses pins the daemon doesn't allow";
+  default:                  return "unknown error";
+  }
+}
+
+// Client: send the waveform file to the daemon and wait until it is played.
+static int submit_to_daemon(const char *socket_path, const char *filename) {
+  struct sockaddr_un addr;
+  if (unix_socket_address(socket_path, &addr) != 0) return 1;
+  struct WaveformFile wf;
+  if (WaveformFile_open(&wf, filename) != 0) return 1;
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    perror(socket_path);
+    WaveformFile_close(&wf);
+    return 1;
+  }
+  // The mapping starts with the header, followed by the records.
+  struct DaemonReply reply;
+  const size_t len = sizeof(struct WaveformFileHeader)
+    + wf.num_records * sizeof(struct GPIOSetClr);
+  const int ok = (write_fully(fd, wf.map, len) == 0 &&
+                  read_fully(fd, &reply, sizeof(reply)) == 0);
+  close(fd);
+  WaveformFile_close(&wf);
+  if (!ok) {
+    fprintf(stderr, "Lost connection to daemon.\n");
+    return 1;
+  }
+  if (reply.status != 0) {
+    fprintf(stderr, "Daemon rejected %s: %s (%d)\n", filename,
+            daemon_error_text(reply.status), reply.status);
+    return 1;
+  }
+  printf("Sent %llu records in %.3f seconds.\n",
+         (unsigned long long)wf.num_records, reply.usec / 1e6);
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Realtime CPU output.
+ *
+ * The CPU experiments run as normal processes, so every now and then the
+ * scheduler gives the core to something else and the output just stops for a
+ * while. That rarely shows in a short capture on the oscilloscope, but it is
+ * what matters for applications that need bounded latency. With -r, the
+ * output loop of experiment 1 or 3
+ *   - is pinned to one core, ideally one isolated with isolcpus= on the kernel
+ *     command line, so that nothing else is scheduled there
+ *   - runs with SCHED_FIFO, so that it is not preempted by normal processes
+ *   - has all its memory locked with mlockall(), so no page faults.
+ * It reads the system timer after each set/clr pair and reports the gaps
+ * between writes once a second. The timer runs at 1Mhz, so anything up to
+ * 1usec shows up as 0 or 1.
+ * --------------------------------------------------------------------------
+ */
+#define REALTIME_REPORT_USEC 1000000
+#define REALTIME_RT_RUNTIME "/proc/sys/kernel/sched_rt_runtime_us"
+
+// Choose the core to run on: the last isolated core, or the last core if
+// none is isolated.
+static int realtime_pick_cpu() {
+  int cpu = -1;
+  FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+  if (f) {
+    // List like "2-3" or "1,3"; skip the separators and keep the last number.
+    int value;
+    while (fscanf(f, "%d", &value) == 1) {
+      cpu = value;
+      if (fgetc(f) == EOF) break;
+    }
+    fclose(f);
+  }
+  if (cpu < 0) {
+    cpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    fprintf(stderr, "No isolated core (isolcpus= kernel parameter); "
+            "using core %d, shared with others.\n", cpu);
+  }
+  return cpu;
+}
+
+// Move the calling thread to "cpu" with realtime priority and lock all
+// memory. Problems are reported, but not fatal: the measurement will show.
+static void realtime_setup(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+    perror("sched_setaffinity");
+
+  // Leave the very top priority to the kernel's own realtime threads.
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+  if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+    perror("sched_setscheduler");
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    perror("mlockall");
+
+  // By default, realtime tasks only get 95% of the time, then the kernel
+  // throttles them to not lock up the system; a busy loop like ours hits that.
+  FILE *f = fopen(REALTIME_RT_RUNTIME, "r");
+  int rt_runtime;
+  if (f && fscanf(f, "%d", &rt_runtime) == 1 && rt_runtime >= 0) {
+    fprintf(stderr, "Note: realtime throttling is on; expect gaps. "
+            "To switch it off: echo -1 > %s\n", REALTIME_RT_RUNTIME);
+  }
+  if (f) fclose(f);
+}
+
+// Output loop of experiment 1 (constant toggle) or 3 (prepared set/clr from
+// memory), measuring the gaps between writes.
+void run_cpu_realtime(int experiment) {
+  // Prepare GPIO
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
+  volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
+  volatile uint32_t *timer = (volatile uint32_t*)gpiodma_mmap_register(ST_BASE)
+    + ST_CLO;
+
+  const int cpu = realtime_pick_cpu();
+  realtime_setup(cpu);
+
+  printf("%d) CPU: realtime output on core %d, measuring gaps between writes.\n"
+         "== Press Ctrl-C to exit.\n", experiment, cpu);
+  printf("%10s %10s %10s %10s %10s\n",
+         "writes/s", "max-gap", ">=10usec", ">=100usec", "worst-ever");
+
+  // Experiment 1 writes the same all the time, experiment 3 goes through
+  // 256 prepared values, just like the originals.
+  const int n = (experiment == 3) ? 256 : 1;
+  struct GPIOSetClr *data = (struct GPIOSetClr*) malloc(n * sizeof(*data));
+  for (int i = 0; i < n; ++i) {
+    data[i].set = (1<<TOGGLE_GPIO);
+    data[i].clr = (1<<TOGGLE_GPIO);
+  }
+
+  uint32_t worst_ever = 0;
+  for (;;) {
+    uint32_t max_gap = 0;
+    uint32_t over_10 = 0, over_100 = 0;
+    uint64_t writes = 0;
+    const uint32_t start = *timer;
+    uint32_t last = start;
+    while (last - start < REALTIME_REPORT_USEC) {
+      for (int i = 0; i < n; ++i) {
+        *set_reg = data[i].set;
+        *clr_reg = data[i].clr;
+        const uint32_t now = *timer;
+        const uint32_t gap = now - last;
+        last = now;
+        if (gap > max_gap) max_gap = gap;
+        if (gap >= 10) {
+          ++over_10;
+          if (gap >= 100) ++over_100;
+        }
+      }
+      writes += 2 * n;
+    }
+
+    // Reporting is outside the measured time.
+    if (max_gap > worst_ever) worst_ever = max_gap;
+    printf("%10.0f %8uus %10u %10u %8uus\n",
+           writes * 1e6 / (last - start), max_gap, over_10, over_100,
+           worst_ever);
+    fflush(stdout);
+  }
+
+  free(data);  // (though never reached due to Ctrl-C)
+}
+
+/* --------------------------------------------------------------------------
+ * Hybrid CPU and DMA output.
+ *
+ * The CPU is by far the fastest way to get data out, but it is busy all the
+ * time doing so; the DMA is slow, but the CPU is free meanwhile. The hybrid
+ * scheduler plays a list of segments, each sent by either: short, latency
+ * critical bursts at full speed by the CPU, running on an isolated core with
+ * realtime priority (see realtime_setup()), the bulk of the waveform by DMA.
+ *
+ * All segments are prepared up-front, so that handing over is cheap:
+ *   - CPU to DMA: right after the last CPU write, the channel is started on
+ *     the control block chain of the next segment.
+ *   - DMA to CPU: the chain is split into short pieces of HYBRID_DMA_PIECE
+ *     records, one per control block. While the DMA is working on the first
+ *     ones, the CPU sleeps; on the last HYBRID_SPIN_PIECES it spins on the
+ *     channel status, and starts writing as soon as the channel is done. The
+ *     last control block waits for the response of its writes, so the DMA's
+ *     output has arrived at GPIO before the channel reports it is done.
+ * So the CPU is only busy for the bursts and a little while at the end of
+ * each DMA segment.
+ * --------------------------------------------------------------------------
+ */
+#define HYBRID_MAX_SEGMENTS 16
+#define HYBRID_DMA_PIECE    1024  // Records per control block; ~0.7ms of DMA.
+#define HYBRID_SPIN_PIECES  2     // Spin on the last pieces, sleep before.
+#define HYBRID_SLEEP_USEC   100
+
+struct HybridSegment {
+  int use_cpu;                     // Send from the CPU; otherwise by DMA.
+  int num_records;
+  struct GPIOSetClr *cpu_records;  // use_cpu: pre-expanded for the CPU loop.
+  struct UncachedMemBlock cb_block;    // DMA: chain of control blocks ...
+  struct UncachedMemBlock data_block;  // ... sending these records.
+  int num_cbs;
+};
+
+struct HybridScheduler {
+  volatile uint32_t *set_reg;
+  volatile uint32_t *clr_reg;
+  volatile struct dma_channel_header *channel;
+  struct HybridSegment segments[HYBRID_MAX_SEGMENTS];
+  int num_segments;
+
+  //-- Statistics, accumulated over all runs.
+  uint64_t cpu_records;    // Records sent by the CPU ...
+  uint64_t cpu_usec;       // ... and the time it took.
+  uint64_t spin_usec;      // Time spent spinning on the DMA to finish.
+  uint32_t max_spin_usec;
+};
+
+static void HybridScheduler_init(struct HybridScheduler *s, int channel) {
+  memset(s, 0, sizeof(*s));
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  s->set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
+  s->clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
+  s->channel = dma_channel_claim(channel);
+}
+
+// Append a segment sending the given levels, masked with "mask", by CPU or
+// DMA.
+static void HybridScheduler_add(struct HybridScheduler *s, int use_cpu,
+                                const uint32_t *levels, int n, uint32_t mask) {
+  assert(s->num_segments < HYBRID_MAX_SEGMENTS && n > 0);
+  struct HybridSegment *seg = &s->segments[s->num_segments++];
+  seg->use_cpu = use_cpu;
+  seg->num_records = n;
+  if (use_cpu) {
+    seg->cpu_records = (struct GPIOSetClr*) malloc(n * sizeof(struct GPIOSetClr));
+    assert(seg->cpu_records);
+    for (int i = 0; i < n; ++i) {
+      seg->cpu_records[i].set =  levels[i] & mask;
+      seg->cpu_records[i].clr = ~levels[i] & mask;
+    }
+    return;
+  }
+
+  seg->num_cbs = (n + HYBRID_DMA_PIECE - 1) / HYBRID_DMA_PIECE;
+  struct UncachedMemBlock blocks[2];
+  const size_t sizes[2] = { seg->num_cbs * sizeof(struct dma_cb),
+                            n * sizeof(struct GPIORegData) };
+  const int failed
+    = UncachedMemBlock_alloc_many(blocks, sizes, 2, board->mem_flags);
+  exit_if(failed != 0, "Allocating uncached memory");
+  seg->cb_block = blocks[0];
+  seg->data_block = blocks[1];
+
+  struct dma_cb *cbs = (struct dma_cb*) seg->cb_block.mem;
+  struct GPIORegData *records = (struct GPIORegData*) seg->data_block.mem;
+  gpiodma_encode_records(levels, n, mask, records);
+  for (int i = 0; i < seg->num_cbs; ++i) {
+    const int first = i * HYBRID_DMA_PIECE;
+    const int count = (n - first) > HYBRID_DMA_PIECE
+      ? HYBRID_DMA_PIECE : (n - first);
+    const int last = (i + 1 == seg->num_cbs);
+    const uint32_t next = last
+      ? 0 : UncachedMemBlock_to_physical(&seg->cb_block, &cbs[i + 1]);
+    gpiodma_build_record_chain(&seg->cb_block, &cbs[i], &seg->data_block,
+                               records + first, count, next);
+  }
+  cbs[seg->num_cbs - 1].info |= DMA_CB_TI_WAIT_RESP;
+  UncachedMemBlock_sync_for_dma(&seg->data_block);
+  UncachedMemBlock_sync_for_dma(&seg->cb_block);
+}
+
+// Wait for the DMA segment to finish: sleep while the channel is on the
+// first pieces, then spin.
+static void HybridScheduler_wait_dma(struct HybridScheduler *s,
+                                     const struct HybridSegment *seg) {
+  const int sleep_cbs = seg->num_cbs - HYBRID_SPIN_PIECES;
+  const uint32_t spin_from = seg->cb_block.bus_addr
+    + (sleep_cbs > 0 ? sleep_cbs : 0) * sizeof(struct dma_cb);
+  while (s->channel->cs & DMA_CS_ACTIVE) {
+    const uint32_t cb = s->channel->cblock;
+    if (cb >= spin_from || cb < seg->cb_block.bus_addr) break;
+    usleep(HYBRID_SLEEP_USEC);
+  }
+
+  const uint32_t start = gpiodma_system_timer_usec();
+  while (s->channel->cs & DMA_CS_ACTIVE)
+    ;
+  const uint32_t spin = gpiodma_system_timer_usec() - start;
+  s->spin_usec += spin;
+  if (spin > s->max_spin_usec) s->max_spin_usec = spin;
+}
+
+// Play all segments once.
+static void HybridScheduler_run(struct HybridScheduler *s) {
+  volatile uint32_t *const set_reg = s->set_reg;
+  volatile uint32_t *const clr_reg = s->clr_reg;
+  for (int i = 0; i < s->num_segments; ++i) {
+    const struct HybridSegment *seg = &s->segments[i];
+    if (!seg->use_cpu) {
+      dma_channel_start(s->channel, seg->cb_block.bus_addr);
+      HybridScheduler_wait_dma(s, seg);
+      continue;
+    }
+    const uint32_t start = gpiodma_system_timer_usec();
+    const struct GPIOSetClr *const end = seg->cpu_records + seg->num_records;
+    for (const struct GPIOSetClr *it = seg->cpu_records; it < end; ++it) {
+      *set_reg = it->set;
+      *clr_reg = it->clr;
+    }
+    s->cpu_usec += gpiodma_system_timer_usec() - start;
+    s->cpu_records += seg->num_records;
+  }
+}
+
+static void HybridScheduler_free(struct HybridScheduler *s) {
+  dma_channel_stop(s->channel);
+  for (int i = 0; i < s->num_segments; ++i) {
+    struct HybridSegment *seg = &s->segments[i];
+    if (seg->use_cpu) {
+      free(seg->cpu_records);
+    } else {
+      struct UncachedMemBlock blocks[2] = { seg->cb_block, seg->data_block };
+      UncachedMemBlock_free_many(blocks, 2);
+    }
+  }
+  s->num_segments = 0;
+}
+
+// Memory used by the DMA segments; the CPU ones are in regular memory.
+static void HybridScheduler_footprint(const struct HybridScheduler *s,
+                                      struct DMAFootprint *fp) {
+  memset(fp, 0, sizeof(*fp));
+  for (int i = 0; i < s->num_segments; ++i) {
+    const struct HybridSegment *seg = &s->segments[i];
+    if (seg->use_cpu) continue;
+    fp->cb_bytes += seg->cb_block.requested_size;
+    fp->payload_bytes += seg->data_block.requested_size;
+    fp->locked_bytes += seg->cb_block.size + seg->data_block.size;
+    fp->samples += seg->num_records;
+  }
+}
+
+// A slow square wave sent by DMA, alternating with a burst of toggling at
+// full CPU speed; reports how busy the CPU is.
+void run_hybrid() {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  const int cpu = realtime_pick_cpu();
+  realtime_setup(cpu);
+
+  const int dma_n = 64 * 1024;
+  const int burst_n = 8 * 1024;
+  uint32_t *levels = (uint32_t*) malloc(dma_n * sizeof(uint32_t));
+  assert(levels);
+  struct HybridScheduler scheduler;
+  HybridScheduler_init(&scheduler, choose_channel());
+  for (int i = 0; i < dma_n; ++i) {
+    levels[i] = ((i / 64) % 2 == 0) ? (1<<TOGGLE_GPIO) : 0;
+  }
+  HybridScheduler_add(&scheduler, 0, levels, dma_n, 1<<TOGGLE_GPIO);
+  for (int i = 0; i < burst_n; ++i) {
+    levels[i] = (i % 2 == 0) ? (1<<TOGGLE_GPIO) : 0;
+  }
+  HybridScheduler_add(&scheduler, 1, levels, burst_n, 1<<TOGGLE_GPIO);
+  free(levels);
+  if (report_memory) {
+    struct DMAFootprint fp;
+    HybridScheduler_footprint(&scheduler, &fp);
+    DMAFootprint_print("19)", &fp);
+  }
+
+  printf("19) Hybrid: bursts from the CPU on core %d, the rest by DMA.\n"
+         "== Press Ctrl-C to exit.\n", cpu);
+  printf("%10s %12s %10s %10s\n", "runs/s", "CPU Mrec/s", "CPU busy", "max-spin");
+  for (;;) {
+    scheduler.cpu_records = scheduler.cpu_usec = scheduler.spin_usec = 0;
+    scheduler.max_spin_usec = 0;
+    int runs = 0;
+    const uint32_t start = gpiodma_system_timer_usec();
+    uint32_t elapsed;
+    do {
+      HybridScheduler_run(&scheduler);
+      ++runs;
+      elapsed = gpiodma_system_timer_usec() - start;
+    } while (elapsed < REALTIME_REPORT_USEC);
+
+    printf("%10.1f %12.3f %9.1f%% %8uus\n", runs * 1e6 / elapsed,
+           scheduler.cpu_records / (double)scheduler.cpu_usec,
+           100.0 * (scheduler.cpu_usec + scheduler.spin_usec) / elapsed,
+           scheduler.max_spin_usec);
+    fflush(stdout);
+  }
+
+  HybridScheduler_free(&scheduler);  // (though never reached due to Ctrl-C)
+}
+
+/* --------------------------------------------------------------------------
+ * Jitter measurement.
+ *
+ * Peak rates don't say much about how regular the output is. With -j, a
+ * sampler thread watches the output pin while the experiment is running: it
+ * reads the GPIO level register and the system timer in a tight loop and
+ * records the time between level changes in a histogram. Once a second, it
+ * prints the median, the tail percentiles and the longest interval.
+ *
+ * This works the same for CPU and DMA experiments, as it just looks at the
+ * pin. It only sees what it samples though: the system timer has a resolution
+ * of 1usec, and if the output changes faster than the sampler loops (it
+ * reports its sample rate), it misses edges. So it is most meaningful for the
+ * paced experiments, and for the long stalls in the others.
+ * With only one core (Pi 1), the sampler competes with the experiment.
+ * --------------------------------------------------------------------------
+ */
+#define JITTER_BUCKETS      1024    // 1usec each, the last collects the rest.
+#define JITTER_REPORT_USEC  1000000
+
+struct JitterHistogram {
+  uint32_t count[JITTER_BUCKETS];
+  uint32_t total;
+  uint32_t max;
+};
+
+static void JitterHistogram_add(struct JitterHistogram *h, uint32_t interval) {
+  ++h->count[interval < JITTER_BUCKETS ? interval : JITTER_BUCKETS - 1];
+  ++h->total;
+  if (interval > h->max) h->max = interval;
+}
+
+// Returns the interval that "fraction" of all intervals are at most.
+static uint32_t JitterHistogram_percentile(const struct JitterHistogram *h,
+                                           double fraction) {
+  const double wanted = fraction * h->total;
+  uint32_t seen = 0;
+  for (int i = 0; i < JITTER_BUCKETS; ++i) {
+    seen += h->count[i];
+    if (seen >= wanted) return i;
+  }
+  return h->max;
+}
+
+static void JitterHistogram_print(const struct JitterHistogram *h,
+                                  uint32_t samples, uint32_t usec) {
+  printf("jitter: %9.0f samples/s %9.0f edges/s; p50 %4uus p99 %4uus "
+         "p99.9 %4uus max %6uus\n",
+         samples * 1e6 / usec, h->total * 1e6 / usec,
+         JitterHistogram_percentile(h, 0.5),
+         JitterHistogram_percentile(h, 0.99),
+         JitterHistogram_percentile(h, 0.999),
+         h->max);
+  fflush(stdout);
+}
+
+static void *jitter_sampler_thread(void *arg) {
+  const uint32_t mask = 1u << *(const int*)arg;
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  volatile uint32_t *lev_reg = gpio_port + (GPIO_LEV_OFFSET / sizeof(uint32_t));
+  volatile uint32_t *timer = (volatile uint32_t*)gpiodma_mmap_register(ST_BASE)
+    + ST_CLO;
+
+  struct JitterHistogram histogram;
+  uint32_t level = *lev_reg & mask;
+  uint32_t last_edge = *timer;
+  for (;;) {
+    memset(&histogram, 0, sizeof(histogram));
+    uint32_t samples = 0;
+    const uint32_t start = *timer;
+    uint32_t now = start;
+    while (now - start < JITTER_REPORT_USEC) {
+      const uint32_t new_level = *lev_reg & mask;
+      now = *timer;
+      ++samples;
+      if (new_level != level) {
+        JitterHistogram_add(&histogram, now - last_edge);
+        level = new_level;
+        last_edge = now;
+      }
+    }
+    JitterHistogram_print(&histogram, samples, now - start);
+  }
+  return NULL;
+}
+
+// Start watching the given GPIO in the background until the program exits.
+static void jitter_sampler_start(int gpio) {
+  static int watched_gpio;
+  watched_gpio = gpio;
+  pthread_t thread;
+  const int err = pthread_create(&thread, NULL, jitter_sampler_thread,
+                                 &watched_gpio);
+  assert(err == 0);
+  (void)err;
+  pthread_detach(thread);
+}
+
+/* --------------------------------------------------------------------------
+ * Benchmark mode. Rather than looking at the scope, measure how many GPIO
+ * writes per second each of the experiments achieves.
+ *
+ * Each benchmark does the same operation as the experiment with the same
+ * number, but not endlessly: it repeats batches of writes until the
+ * time window is over and times them with the system timer. The DMA
+ * benchmarks do so with a chain of control blocks that ends, and check
+ * when the channel becomes inactive.
+ *
+ * Note, the CPU loops need a counter to do a finite number of writes, so
+ * on the slower Pis they can come out slightly below the endless versions.
+ * --------------------------------------------------------------------------
+ */
+#define BENCHMARK_WINDOW_USEC 1000000
+
+// Report writes (to GPIO set or clr register) and output periods (one set
+// and one clr of the toggled pin) achieved in the given time.
+static void bench_report(int experiment, const char *name,
+                         uint64_t writes, uint64_t periods, uint32_t usec) {
+  printf("%d) %-40s %10.3f Mwrites/s %10.3f MHz  (%llu writes in %.3fs)\n",
+         experiment, name, writes / (double)usec, periods / (double)usec,
+         (unsigned long long)writes, usec / 1e6);
+}
+
+static void bench_cpu_direct() {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
+  volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
+
+  // Unroll a few to keep the loop overhead low.
+#define TOGGLE_4_TIMES                                  \
+  *set_reg = (1<<TOGGLE_GPIO); *clr_reg = (1<<TOGGLE_GPIO); \
+  *set_reg = (1<<TOGGLE_GPIO); *clr_reg = (1<<TOGGLE_GPIO); \
+  *set_reg = (1<<TOGGLE_GPIO); *clr_reg = (1<<TOGGLE_GPIO); \
+  *set_reg = (1<<TOGGLE_GPIO); *clr_reg = (1<<TOGGLE_GPIO)
+
+  const int batch = 1 << 16;
+  uint64_t periods = 0;
+  const uint32_t start = gpiodma_system_timer_usec();
+  uint32_t elapsed;
+  do {
+    for (int i = 0; i < batch; i += 4) {
+      TOGGLE_4_TIMES;
+    }
+    periods += batch;
+    elapsed = gpiodma_system_timer_usec() - start;
+  } while (elapsed < BENCHMARK_WINDOW_USEC);
+#undef TOGGLE_4_TIMES
+
+  bench_report(1, "CPU: direct", 2 * periods, periods, elapsed);
+}
+
+static void bench_cpu_from_memory_masked() {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
+  volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
+
+  const int n = 256;
+  uint32_t *gpio_data = (uint32_t*) malloc(n * sizeof(*gpio_data));
+  for (int i = 0; i < n; ++i) {
+    gpio_data[i] = (i % 2 == 0) ? (1<<TOGGLE_GPIO) : 0;
+  }
+
+  const uint32_t mask = (1<<TOGGLE_GPIO);
+  const uint32_t *start = gpio_data;
+  const uint32_t *end   = start + n;
+  uint64_t writes = 0;
+  const uint32_t start_time = gpiodma_system_timer_usec();
+  uint32_t elapsed;
+  do {
+    for (int round = 0; round < 256; ++round) {
+      for (const uint32_t *it = start; it < end; ++it) {
+        if (( *it & mask) != 0) *set_reg =  *it & mask;
+        if ((~*it & mask) != 0) *clr_reg = ~*it & mask;
+      }
+    }
+    writes += 256 * n;   // Each word results in exactly one write here.
+    elapsed = gpiodma_system_timer_usec() - start_time;
+  } while (elapsed < BENCHMARK_WINDOW_USEC);
+
+  bench_report(2, "CPU: memory masked", writes, writes / 2, elapsed);
+  free(gpio_data);
+}
+
+// Experiment 3 and 4 only differ in the memory the data comes from.
+// One output period of the measured pin takes "records_per_period" records.
+static void bench_cpu_set_reset_from(int experiment, const char *name,
+                                     const void *data, int n,
+                                     int records_per_period) {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
+  volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
+
+  struct GPIOData {
+    uint32_t set;
+    uint32_t clr;
+  };
+
+  const struct GPIOData *start = (const struct GPIOData*) data;
+  const struct GPIOData *end = start + n;
+  uint64_t periods = 0;
+  const uint32_t start_time = gpiodma_system_timer_usec();
+  uint32_t elapsed;
+  do {
+    for (int round = 0; round < 16; ++round) {
+      for (const struct GPIOData *it = start; it < end; ++it) {
+        *set_reg = it->set;
+        *clr_reg = it->clr;
+      }
+    }
+    periods += 16 * n;   // (counting records here)
+    elapsed = gpiodma_system_timer_usec() - start_time;
+  } while (elapsed < BENCHMARK_WINDOW_USEC);
+
+  bench_report(experiment, name, 2 * periods, periods / records_per_period,
+               elapsed);
+}
+
+static void bench_cpu_from_memory_set_reset(int uncached) {
+  const int n = 256;
+  const int set_clr_size = 2 * sizeof(uint32_t);
+  uint32_t *gpio_data;
+  struct UncachedMemBlock memblock = { NULL, 0, 0, 0, 0 };
+  if (uncached) {
+    memblock = alloc_block(n * set_clr_size);
+    gpio_data = (uint32_t*) memblock.mem;
+  } else {
+    gpio_data = (uint32_t*) malloc(n * set_clr_size);
+  }
+  for (int i = 0; i < 2 * n; ++i) {
+    gpio_data[i] = (1<<TOGGLE_GPIO);   // set and clr: both the same.
+  }
+
+  if (uncached) {
+    bench_cpu_set_reset_from(4, "CPU: UNCACHED memory set/clr",
+                             gpio_data, n, 1);
+    UncachedMemBlock_free(&memblock);
+  } else {
+    bench_cpu_set_reset_from(3, "CPU: memory set/clr", gpio_data, n, 1);
+    free(gpio_data);
+  }
+}
+
+// Time one of the kernels on the given data. Each call sends
+// CPU_KERNEL_RECORDS words or records.
+static uint32_t bench_cpu_kernel(int variant, const void *data,
+                                 volatile uint32_t *set_reg,
+                                 volatile uint32_t *clr_reg, uint64_t *calls) {
+  const uint32_t start_time = gpiodma_system_timer_usec();
+  uint32_t elapsed;
+  *calls = 0;
+  do {
+    for (int round = 0; round < 16; ++round) {
+      switch (variant) {
+      case 0: cpu_kernel_masked_toggle(data, set_reg, clr_reg); break;
+      case 1: cpu_kernel_masked_bus(data, set_reg, clr_reg); break;
+      default: cpu_kernel_set_reset(data, set_reg, clr_reg); break;
+      }
+    }
+    *calls += 16;
+    elapsed = gpiodma_system_timer_usec() - start_time;
+  } while (elapsed < BENCHMARK_WINDOW_USEC);
+  return elapsed;
+}
+
+// Compare the specialized kernels with the generic loops of experiment 2 to 4
+// on the same data; with "with_generic", these are run in between for an
+// easy side by side comparison.
+static void bench_cpu_kernels(int with_generic) {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+  volatile uint32_t *set_reg = gpio_port + (GPIO_SET_OFFSET / sizeof(uint32_t));
+  volatile uint32_t *clr_reg = gpio_port + (GPIO_CLR_OFFSET / sizeof(uint32_t));
+
+  // Same data as the generic loops, and a counter on the default bus.
+  const int n = CPU_KERNEL_RECORDS;
+  struct ParallelBus bus;
+  ParallelBus_init(&bus, kDefaultBusPins,
+                   sizeof(kDefaultBusPins) / sizeof(kDefaultBusPins[0]));
+  assert(bus.mask == DEFAULT_BUS_MASK);
+  for (int i = 0; i < bus.width; ++i) {
+    gpiodma_gpio_init_output(gpio_port, kDefaultBusPins[i]);
+  }
+  uint32_t *words = (uint32_t*) malloc(n * sizeof(*words));
+  uint32_t *bus_words = (uint32_t*) malloc(n * sizeof(*bus_words));
+  struct GPIOSetClr *records
+    = (struct GPIOSetClr*) malloc(n * sizeof(*records));
+  assert(words && bus_words && records);
+  struct UncachedMemBlock memblock
+    = alloc_block(n * sizeof(struct GPIOSetClr));
+  struct GPIOSetClr *uncached_records = (struct GPIOSetClr*) memblock.mem;
+  for (int i = 0; i < n; ++i) {
+    words[i] = (i % 2 == 0) ? (1<<TOGGLE_GPIO) : 0;
+    bus_words[i] = ParallelBus_set_bits(&bus, i);
+    records[i].set = records[i].clr = (1<<TOGGLE_GPIO);
+    uncached_records[i] = records[i];
+  }
+
+  uint64_t calls;
+  uint32_t elapsed;
+
+  // Masked: the single pin needs one write per word, the bus two. Both toggle
+  // the (lowest) pin with every word.
+  if (with_generic) bench_cpu_from_memory_masked();
+  elapsed = bench_cpu_kernel(0, words, set_reg, clr_reg, &calls);
+  bench_report(18, "Kernel: memory masked, one pin",
+               calls * n, calls * n / 2, elapsed);
+  elapsed = bench_cpu_kernel(1, bus_words, set_reg, clr_reg, &calls);
+  bench_report(18, "Kernel: memory masked, bus",
+               2 * calls * n, calls * n / 2, elapsed);
+
+  // Set/clr: two writes and one period per record.
+  if (with_generic) bench_cpu_from_memory_set_reset(0);
+  elapsed = bench_cpu_kernel(2, records, set_reg, clr_reg, &calls);
+  bench_report(18, "Kernel: memory set/clr",
+               2 * calls * n, calls * n, elapsed);
+  if (with_generic) bench_cpu_from_memory_set_reset(1);
+  elapsed = bench_cpu_kernel(2, uncached_records, set_reg, clr_reg, &calls);
+  bench_report(18, "Kernel: UNCACHED memory set/clr",
+               2 * calls * n, calls * n, elapsed);
+
+  UncachedMemBlock_free(&memblock);
+  free(records);
+  free(bus_words);
+  free(words);
+}
+
+// Run the control block chain starting at the given bus address until it
+// ends, again and again until the time window is over. Returns the elapsed
+// time and the number of runs.
+static uint32_t bench_dma_chain_for(uint32_t cb_bus_addr, int *runs,
+                                    uint32_t window_usec) {
+  volatile struct dma_channel_header *channel
+    = dma_channel_claim(choose_channel());
+  *runs = 0;
+  const uint32_t start_time = gpiodma_system_timer_usec();
+  uint32_t elapsed;
+  do {
+    dma_channel_start(channel, cb_bus_addr);
+    while (channel->cs & DMA_CS_ACTIVE) {
+      usleep(50);
+    }
+    ++*runs;
+    elapsed = gpiodma_system_timer_usec() - start_time;
+  } while (elapsed < window_usec);
+  dma_channel_stop(channel);
+  return elapsed;
+}
+
+static uint32_t bench_dma_chain(uint32_t cb_bus_addr, int *runs) {
+  return bench_dma_chain_for(cb_bus_addr, runs, BENCHMARK_WINDOW_USEC);
+}
+
+static void bench_dma_single_transfer_per_cb() {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  struct GPIOData {
+    uint32_t set;
+    uint32_t clr;
+  };
+
+  // As in run_dma_single_transfer_per_cb(), but instead of looping one
+  // control block, we chain many that all send the same data.
+  const int num_cbs = 16384;
+  const size_t cb_size = num_cbs * sizeof(struct dma_cb);
+  struct UncachedMemPool pool
+    = create_pool(UncachedMemPool_chunk_size(sizeof(struct GPIOData))
+                  + UncachedMemPool_chunk_size(cb_size));
+  struct UncachedMemBlock memblock
+    = UncachedMemPool_alloc(&pool, sizeof(struct GPIOData));
+  struct UncachedMemBlock cb_memblock = UncachedMemPool_alloc(&pool, cb_size);
+  struct GPIOData *gpio_data = (struct GPIOData*) memblock.mem;
+  gpio_data->set = (1<<TOGGLE_GPIO);
+  gpio_data->clr = (1<<TOGGLE_GPIO);
+
+  struct dma_cb *cbs = (struct dma_cb*) cb_memblock.mem;
+  for (int i = 0; i < num_cbs; ++i) {
+    cbs[i].info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
+                     DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_TDMODE);
+    cbs[i].src    = UncachedMemBlock_to_physical(&memblock, gpio_data);
+    cbs[i].dst    = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+    cbs[i].length = DMA_CB_TXFR_LEN_YLENGTH(2) | DMA_CB_TXFR_LEN_XLENGTH(4);
+    cbs[i].stride = DMA_CB_STRIDE_D_STRIDE(8) | DMA_CB_STRIDE_S_STRIDE(0);
+    cbs[i].next   = (i + 1 < num_cbs)
+      ? UncachedMemBlock_to_physical(&cb_memblock, &cbs[i+1])
+      : 0;
+  }
+
+  UncachedMemBlock_sync_for_dma(&pool.block);
+
+  int runs;
+  const uint32_t elapsed = bench_dma_chain(cb_memblock.bus_addr, &runs);
+  const uint64_t periods = (uint64_t)runs * num_cbs;
+  bench_report(5, "DMA: single control block per set/clr",
+               2 * periods, periods, elapsed);
+
+  UncachedMemPool_free(&pool, &memblock);
+  UncachedMemPool_free(&pool, &cb_memblock);
+  UncachedMemPool_destroy(&pool);
+}
+
+static void bench_dma_multi_transfer_per_cb(const struct MemPolicy *policy) {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  // As in run_dma_multi_transfer_per_cb(), but a chain of control blocks
+  // that all send the same data once, instead of one looping.
+  const int n = 16384;
+  const int num_cbs = 16;
+  const size_t data_size = n * sizeof(struct GPIORegData);
+  const size_t cb_size = num_cbs * sizeof(struct dma_cb);
+  struct UncachedMemPool pool
+    = create_pool_with_flags(UncachedMemPool_chunk_size(data_size) +
+                             UncachedMemPool_chunk_size(cb_size),
+                             policy->mem_flags);
+  struct UncachedMemBlock memblock = UncachedMemPool_alloc(&pool, data_size);
+  struct UncachedMemBlock cb_memblock = UncachedMemPool_alloc(&pool, cb_size);
+  struct GPIORegData *gpio_data = (struct GPIORegData*) memblock.mem;
+  for (int i = 0; i < n; ++i) {
+    gpio_data[i].set = (1<<TOGGLE_GPIO);
+    gpio_data[i].clr = (1<<TOGGLE_GPIO);
+  }
+
+  // Each sends all n records, which fit in one control block.
+  struct dma_cb *cbs = (struct dma_cb*) cb_memblock.mem;
+  for (int i = num_cbs - 1; i >= 0; --i) {
+    const uint32_t next = (i + 1 < num_cbs)
+      ? UncachedMemBlock_to_physical(&cb_memblock, &cbs[i+1])
+      : 0;
+    gpiodma_build_record_chain(&cb_memblock, &cbs[i], &memblock, gpio_data, n,
+                               next);
+  }
+
+  UncachedMemBlock_sync_for_dma(&pool.block);
+
+  int runs;
+  const uint32_t elapsed = bench_dma_chain(cb_memblock.bus_addr, &runs);
+  const uint64_t periods = (uint64_t)runs * num_cbs * n;
+  char name[64];
+  snprintf(name, sizeof(name), "DMA: multiple set/clr per cb; %s memory",
+           policy->name);
+  bench_report(6, name, 2 * periods, periods, elapsed);
+
+  UncachedMemPool_free(&pool, &memblock);
+  UncachedMemPool_free(&pool, &cb_memblock);
+  UncachedMemPool_destroy(&pool);
+}
+
+// As bench_dma_chain_for(), on a DMA4 channel. The chain starts at the
+// given physical address.
+static uint32_t bench_dma4_chain(uint32_t cb_phys_addr, int *runs) {
+  volatile struct dma4_channel_header *channel
+    = dma4_channel_claim(choose_dma4_channel());
+  *runs = 0;
+  const uint32_t start_time = gpiodma_system_timer_usec();
+  uint32_t elapsed;
+  do {
+    dma4_channel_start(channel, cb_phys_addr);
+    while (channel->cs & DMA4_CS_ACTIVE) {
+      usleep(50);
+    }
+    ++*runs;
+    elapsed = gpiodma_system_timer_usec() - start_time;
+  } while (elapsed < BENCHMARK_WINDOW_USEC);
+  dma4_channel_stop(channel);
+  return elapsed;
+}
+
+// Experiments 5 and 6 as in run_dma4_transfer(), with the same chains as
+// bench_dma_single_transfer_per_cb() and bench_dma_multi_transfer_per_cb().
+static void bench_dma4_transfer(int experiment) {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  const int n = (experiment == 5) ? 1 : 16384;
+  const int num_cbs = (experiment == 5) ? 16384 : 16;
+  const size_t data_size = (experiment == 5)
+    ? 2 * sizeof(uint32_t) : n * sizeof(struct GPIORegData);
+  const size_t cb_size = num_cbs * sizeof(struct dma4_cb);
+  struct UncachedMemPool pool
+    = create_pool(UncachedMemPool_chunk_size(data_size) +
+                  UncachedMemPool_chunk_size(cb_size));
+  struct UncachedMemBlock memblock = UncachedMemPool_alloc(&pool, data_size);
+  struct UncachedMemBlock cb_memblock = UncachedMemPool_alloc(&pool, cb_size);
+  memset(memblock.mem, 0, data_size);
+  uint32_t *words = (uint32_t*) memblock.mem;
+  for (size_t i = 0; i < data_size / sizeof(uint32_t); i += 4) {
+    words[i] = (1<<TOGGLE_GPIO);                           // set
+    words[(experiment == 5) ? i + 1 : i + 3] = (1<<TOGGLE_GPIO);  // clr
+  }
+
+  const uint32_t cb_phys = GPIODMA_BUS_TO_PHYS(cb_memblock.bus_addr);
+  struct dma4_cb *cbs = (struct dma4_cb*) cb_memblock.mem;
+  memset(cbs, 0, cb_size);
+  for (int i = 0; i < num_cbs; ++i) {
+    cbs[i].ti  = DMA4_TI_TDMODE | DMA4_TI_WAIT_RESP;
+    cbs[i].src = GPIODMA_BUS_TO_PHYS(memblock.bus_addr);
+    cbs[i].dst = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+    if (experiment == 5) {
+      cbs[i].srci   = DMA4_INFO_INC | DMA4_INFO_SIZE_32;
+      cbs[i].dsti   = (DMA4_INFO_ADDR_HI(DMA4_PERI_ADDR_HI) | DMA4_INFO_INC |
+                       DMA4_INFO_SIZE_32 | DMA4_INFO_STRIDE(8));
+      cbs[i].length = DMA4_LEN_YLENGTH(2) | DMA4_LEN_XLENGTH(4);
+    } else {
+      cbs[i].srci   = DMA4_INFO_INC | DMA4_INFO_SIZE_128;
+      cbs[i].dsti   = (DMA4_INFO_ADDR_HI(DMA4_PERI_ADDR_HI) | DMA4_INFO_INC |
+                       DMA4_INFO_SIZE_32 | DMA4_INFO_STRIDE(-16));
+      cbs[i].length = DMA4_LEN_YLENGTH(n) | DMA4_LEN_XLENGTH(16);
+    }
+    cbs[i].next = (i + 1 < num_cbs)
+      ? DMA4_CB_ADDR(cb_phys + (i + 1) * sizeof(struct dma4_cb))
+      : 0;
+  }
+
+  UncachedMemBlock_sync_for_dma(&pool.block);
+
+  int runs;
+  const uint32_t elapsed = bench_dma4_chain(cb_phys, &runs);
+  const uint64_t periods = (uint64_t)runs * num_cbs * n;
+  bench_report(experiment, (experiment == 5)
+               ? "DMA4: single control block per set/clr"
+               : "DMA4: multiple set/clr per cb",
+               2 * periods, periods, elapsed);
+
+  UncachedMemPool_free(&pool, &memblock);
+  UncachedMemPool_free(&pool, &cb_memblock);
+  UncachedMemPool_destroy(&pool);
+}
+
+static void bench_cpu_parallel_bus(const int *pins, int width) {
+  struct ParallelBus bus;
+  ParallelBus_init(&bus, pins, width);
+  struct GPIOSetClr *gpio_data;
+  const int n = prepare_parallel_bus_counter(&bus, &gpio_data);
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  for (int i = 0; i < width; ++i) {
+    gpiodma_gpio_init_output(gpio_port, pins[i]);
+  }
+  // The output frequency is that of the lowest bit of the counter, which
+  // toggles with every sample.
+  bench_cpu_set_reset_from(9, "CPU: parallel bus counter", gpio_data, n, 2);
+  free(gpio_data);
+}
+
+// Experiments 5 and 6 need a destination stride to skip the gap between the
+// GPIO set and clr registers, which seems to take extra time. These layouts
+// avoid destination strides altogether; each is reported with the memory it
+// needs per sample (set/clr pair), so speed and memory can be traded off.
+static void bench_dma_stride_free() {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  const int n = 4096;   // Samples
+  const size_t data_size = n * sizeof(struct GPIORegData);
+  const size_t cb_size = 2 * n * sizeof(struct dma_cb);
+  struct UncachedMemPool pool
+    = create_pool(UncachedMemPool_chunk_size(data_size) +
+                  UncachedMemPool_chunk_size(cb_size));
+  struct UncachedMemBlock data_block = UncachedMemPool_alloc(&pool, data_size);
+  struct UncachedMemBlock cb_block = UncachedMemPool_alloc(&pool, cb_size);
+  assert(data_block.mem && cb_block.mem);
+  struct dma_cb *cbs = (struct dma_cb*) cb_block.mem;
+  const uint32_t set_reg = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+  const uint32_t clr_reg = PHYSICAL_GPIO_BUS + GPIO_CLR_OFFSET;
+  const uint32_t bit = (1<<TOGGLE_GPIO);
+
+  for (int layout = 0; layout < 4; ++layout) {
+    memset(cbs, 0, cb_size);
+    int num_cbs = 0;
+    uint64_t writes_per_run = 2 * n;
+    uint64_t periods_per_run = n;   // Toggles of the pin per run.
+    size_t bytes_per_sample = 0;
+    const char *per = "sample";     // What bytes_per_sample is per.
+    const char *name = NULL;
+    if (layout == 0) {
+      // Set and clr each get their own 1D control block.
+      struct GPIOSetClr *data = (struct GPIOSetClr*) data_block.mem;
+      for (int i = 0; i < n; ++i) {
+        data[i].set = data[i].clr = bit;
+        for (int j = 0; j < 2; ++j) {
+          struct dma_cb *cb = &cbs[num_cbs++];
+          cb->info   = DMA_CB_TI_NO_WIDE_BURSTS;
+          cb->src    = UncachedMemBlock_to_physical(&data_block, j == 0
+                                                    ? &data[i].set
+                                                    : &data[i].clr);
+          cb->dst    = j == 0 ? set_reg : clr_reg;
+          cb->length = sizeof(uint32_t);
+        }
+      }
+      name = "DMA: separate set and clr control blocks";
+      bytes_per_sample = 2 * sizeof(struct dma_cb) + sizeof(struct GPIOSetClr);
+    } else if (layout == 1) {
+      // One 1D control block per record: writing through set..clr
+      // including the unused registers in between, no stride needed.
+      struct GPIORegData *data = (struct GPIORegData*) data_block.mem;
+      for (int i = 0; i < n; ++i) {
+        const struct GPIORegData record = { bit, 0, 0, bit };
+        data[i] = record;
+        struct dma_cb *cb = &cbs[num_cbs++];
+        cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
+                      DMA_CB_TI_NO_WIDE_BURSTS);
+        cb->src    = UncachedMemBlock_to_physical(&data_block, &data[i]);
+        cb->dst    = set_reg;
+        cb->length = sizeof(struct GPIORegData);
+      }
+      name = "DMA: one 1D set..clr record per block";
+      bytes_per_sample = sizeof(struct dma_cb) + sizeof(struct GPIORegData);
+    } else if (layout == 2) {
+      // Set once, then a single block writing all the clr values to the
+      // same register; e.g. to clear the lines of a bus one after another.
+      uint32_t *data = (uint32_t*) data_block.mem;
+      for (int i = 0; i <= n; ++i) data[i] = bit;
+      cbs[0].info   = DMA_CB_TI_NO_WIDE_BURSTS;
+      cbs[0].src    = UncachedMemBlock_to_physical(&data_block, &data[0]);
+      cbs[0].dst    = set_reg;
+      cbs[0].length = sizeof(uint32_t);
+      cbs[1].info   = DMA_CB_TI_SRC_INC | DMA_CB_TI_NO_WIDE_BURSTS;
+      cbs[1].src    = UncachedMemBlock_to_physical(&data_block, &data[1]);
+      cbs[1].dst    = clr_reg;
+      cbs[1].length = n * sizeof(uint32_t);
+      num_cbs = 2;
+      writes_per_run = n + 1;
+      periods_per_run = 1;   // Only the first clr changes the pin.
+      name = "DMA: set once, then chain of clr writes";
+      bytes_per_sample = sizeof(uint32_t);
+      per = "write";         // Not a set/clr pair as the others.
+    } else {
+      // Only a source stride: from interleaved set/clr pairs, one 2D block
+      // picks all the set values, one all the clr values; each goes to a
+      // fixed register. Note that this sends all sets, then all clrs.
+      struct GPIOSetClr *data = (struct GPIOSetClr*) data_block.mem;
+      for (int i = 0; i < n; ++i) data[i].set = data[i].clr = bit;
+      for (int j = 0; j < 2; ++j) {
+        struct dma_cb *cb = &cbs[num_cbs++];
+        cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_NO_WIDE_BURSTS |
+                      DMA_CB_TI_TDMODE);
+        cb->src    = UncachedMemBlock_to_physical(&data_block, j == 0
+                                                  ? &data[0].set : &data[0].clr);
+        cb->dst    = j == 0 ? set_reg : clr_reg;
+        cb->length = (DMA_CB_TXFR_LEN_YLENGTH(n) |
+                      DMA_CB_TXFR_LEN_XLENGTH(sizeof(uint32_t)));
+        cb->stride = (DMA_CB_STRIDE_D_STRIDE(0) |
+                      DMA_CB_STRIDE_S_STRIDE(sizeof(uint32_t)));
+      }
+      periods_per_run = 1;   // All sets, then all clrs: one toggle.
+      name = "DMA: source stride only (sets, then clrs)";
+      bytes_per_sample = sizeof(struct GPIOSetClr);
+    }
+    for (int i = 0; i < num_cbs; ++i) {
+      cbs[i].next = (i + 1 < num_cbs)
+        ? UncachedMemBlock_to_physical(&cb_block, &cbs[i+1]) : 0;
+    }
+    UncachedMemBlock_sync_for_dma(&pool.block);
+
+    int runs;
+    const uint32_t elapsed = bench_dma_chain(cb_block.bus_addr, &runs);
+    bench_report(17, name, runs * writes_per_run,
+                 (uint64_t)runs * periods_per_run, elapsed);
+    printf("   %-40s %10d bytes/%s\n", "", (int)bytes_per_sample, per);
+  }
+
+  UncachedMemPool_free(&pool, &data_block);
+  UncachedMemPool_free(&pool, &cb_block);
+  UncachedMemPool_destroy(&pool);
+}
+
+// Sweep the parameters of the 2D transfer of experiment 6 that might make
+// a difference for the DMA engine: how much it writes per record, gaps
+// between the records in memory, wide bursts, the burst length, the width
+// of the source reads and the memory alias. The result is printed as CSV to
+// stdout, one line per combination, for further analysis. With 480
+// combinations, each is only measured for a tenth of a second.
+#define BENCHMARK_SWEEP_USEC 100000
+
+static void bench_dma_sweep() {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  // Record sizes: just set; set of both banks; set..clr; up to the level
+  // registers, which ignore writes.
+  static const int kXLengths[] = { 4, 8, 16, 32 };
+  static const int kSrcGaps[] = { 0, 16 };      // Unused bytes after a record.
+  static const int kBurstLengths[] = { 0, 1, 3, 7, 15 };
+  const int n = 4096;     // Records per control block.
+  const int num_cbs = 4;
+  const size_t max_data_size = n * (32 + 16);
+  const size_t cb_size = num_cbs * sizeof(struct dma_cb);
+
+  printf("board,policy,xlength,src_gap,wide_bursts,burst_length,src_width,"
+         "records_per_sec,mbytes_per_sec\n");
+  for (int p = 0; p < GPIODMA_NUM_MEM_POLICIES; ++p) {
+    const struct MemPolicy *policy = &gpiodma_mem_policies[p];
+    if (board->is_bcm2711 && !policy->bcm2711_ok) continue;
+    struct UncachedMemPool pool = create_pool_with_flags(
+      UncachedMemPool_chunk_size(max_data_size) +
+      UncachedMemPool_chunk_size(cb_size), policy->mem_flags);
+    struct UncachedMemBlock data_block = UncachedMemPool_alloc(&pool,
+                                                               max_data_size);
+    struct UncachedMemBlock cb_block = UncachedMemPool_alloc(&pool, cb_size);
+    assert(data_block.mem && cb_block.mem);
+    struct dma_cb *cbs = (struct dma_cb*) cb_block.mem;
+
+    for (size_t x = 0; x < sizeof(kXLengths)/sizeof(kXLengths[0]); ++x) {
+      const int xlength = kXLengths[x];
+      for (size_t g = 0; g < sizeof(kSrcGaps)/sizeof(kSrcGaps[0]); ++g) {
+        // Records toggling the pin: set at offset 0, clr at offset 12.
+        const int src_gap = kSrcGaps[g];
+        uint8_t *data = (uint8_t*) data_block.mem;
+        memset(data, 0x00, max_data_size);
+        for (int i = 0; i < n; ++i) {
+          uint32_t *record = (uint32_t*) (data + i * (xlength + src_gap));
+          record[0] = (1<<TOGGLE_GPIO);
+          if (xlength >= 16) record[3] = (1<<TOGGLE_GPIO);
+        }
+
+        for (int wide = 0; wide <= 1; ++wide) {
+          for (size_t b = 0; b < sizeof(kBurstLengths)/sizeof(kBurstLengths[0]);
+               ++b) {
+            for (int src_width = 0; src_width <= 1; ++src_width) {
+              for (int i = 0; i < num_cbs; ++i) {
+                struct dma_cb *cb = &cbs[i];
+                cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
+                              DMA_CB_TI_TDMODE |
+                              DMA_CB_TI_BURST_LENGTH(kBurstLengths[b]) |
+                              (wide ? 0 : DMA_CB_TI_NO_WIDE_BURSTS) |
+                              (src_width ? DMA_CB_TI_SRC_WIDTH : 0));
+                cb->src    = data_block.bus_addr;
+                cb->dst    = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+                cb->length = (DMA_CB_TXFR_LEN_YLENGTH(n) |
+                              DMA_CB_TXFR_LEN_XLENGTH(xlength));
+                cb->stride = (DMA_CB_STRIDE_D_STRIDE(-xlength) |
+                              DMA_CB_STRIDE_S_STRIDE(src_gap));
+                cb->next   = (i + 1 < num_cbs)
+                  ? UncachedMemBlock_to_physical(&cb_block, &cbs[i+1]) : 0;
+              }
+              UncachedMemBlock_sync_for_dma(&pool.block);
+
+              int runs;
+              const uint32_t elapsed
+                = bench_dma_chain_for(cb_block.bus_addr, &runs,
+                                      BENCHMARK_SWEEP_USEC);
+              const double records = (double)runs * num_cbs * n;
+              printf("%s,%s,%d,%d,%d,%d,%d,%.0f,%.3f\n",
+                     board->name, policy->name, xlength, src_gap, wide,
+                     kBurstLengths[b], src_width ? 128 : 32,
+                     records * 1e6 / elapsed, records * xlength / elapsed);
+              fflush(stdout);
+            }
+          }
+        }
+      }
+    }
+
+    UncachedMemPool_free(&pool, &data_block);
+    UncachedMemPool_free(&pool, &cb_block);
+    UncachedMemPool_destroy(&pool);
+  }
+}
+
+// Unpaced striping across channels: sweep over number of channels and
+// the priority they run with, and see which aggregate rate we get.
+static void bench_dma_striped() {
+  volatile uint32_t *gpio_port = gpiodma_mmap_register(GPIO_REGISTER_BASE);
+  gpiodma_gpio_init_output(gpio_port, TOGGLE_GPIO);
+
+  const int n = 16384;
+  const int repeat = 16;
+  struct GPIORegData *records = (struct GPIORegData*) calloc(n, sizeof(*records));
+  for (int i = 0; i < n; ++i) {
+    records[i].set = (1<<TOGGLE_GPIO);
+    records[i].clr = (1<<TOGGLE_GPIO);
+  }
+
+  int channels[DMA_STRIPE_MAX_CHANNELS];
+  const int num_channels
+    = dma_find_free_channels(channels, DMA_STRIPE_MAX_CHANNELS);
+
+  const int priorities[] = { 0, 8, 15 };
+  for (int k = 1; k <= num_channels; ++k) {
+    for (int p = 0; p < (int)(sizeof(priorities)/sizeof(priorities[0])); ++p) {
+      struct DMAStriped striped;
+      DMAStriped_init(&striped, channels, k, records, n, repeat);
+      if (report_memory && p == 0) {
+        char name[32];
+        snprintf(name, sizeof(name), "13) %d channel(s)", k);
+        struct DMAFootprint fp;
+        DMAStriped_footprint(&striped, n, &fp);
+        DMAFootprint_print(name, &fp);
+      }
+
+      int runs = 0;
+      const uint32_t start_time = gpiodma_system_timer_usec();
+      uint32_t elapsed;
+      do {
+        DMAStriped_start(&striped, priorities[p], priorities[p]);
+        while (DMAStriped_active(&striped)) {
+          usleep(50);
+        }
+        ++runs;
+        elapsed = gpiodma_system_timer_usec() - start_time;
+      } while (elapsed < BENCHMARK_WINDOW_USEC);
+
+      // All slices together are n records, padded to a multiple of k.
+      const uint64_t periods
+        = (uint64_t)runs * repeat * ((n + k - 1) / k) * k;
+      char name[64];
+      snprintf(name, sizeof(name), "DMA: striped; %d channel(s), priority %2d",
+               k, priorities[p]);
+      bench_report(13, name, 2 * periods, periods, elapsed);
+      DMAStriped_free(&striped);
+    }
+  }
+  free(records);
+}
+
+// Not an experiment by itself: how long does it take to allocate and free
+// many blocks, one mailbox round-trip at a time vs. batched.
+static void bench_alloc_batched() {
+  const int n = 256;
+  struct UncachedMemBlock *blocks
+    = (struct UncachedMemBlock*) malloc(n * sizeof(*blocks));
+  size_t *sizes = (size_t*) malloc(n * sizeof(*sizes));
+  for (int i = 0; i < n; ++i) sizes[i] = GPIODMA_PAGE_SIZE;
+
+  UncachedMemBlock_set_verbose(0);
+  for (int method = 0; method < 2; ++method) {
+    const uint32_t start_time = gpiodma_system_timer_usec();
+    if (method == 0) {
+      for (int i = 0; i < n; ++i)
+        blocks[i] = UncachedMemBlock_alloc_with_flags(sizes[i], board->mem_flags);
+    } else {
+      UncachedMemBlock_alloc_many(blocks, sizes, n, board->mem_flags);
+    }
+    const uint32_t alloc_time = gpiodma_system_timer_usec() - start_time;
+    for (int i = 0; i < n; ++i)
+      exit_if(blocks[i].mem == NULL, "Allocating uncached memory");
+    if (method == 0) {
+      for (int i = 0; i < n; ++i)
+        UncachedMemBlock_free(&blocks[i]);
+    } else {
+      UncachedMemBlock_free_many(blocks, n);
+    }
+    const uint32_t free_time
+      = gpiodma_system_timer_usec() - start_time - alloc_time;
+    printf("M) %-40s %8.1f usec/alloc %8.1f usec/free\n",
+           method == 0 ? "Mailbox: one call per block" : "Mailbox: batched",
+           alloc_time / (double)n, free_time / (double)n);
+  }
+  UncachedMemBlock_set_verbose(1);
+  free(sizes);
+  free(blocks);
+}
+
+// Not an experiment by itself: measure how fast we can prepare data for DMA
+// in uncached memory. Compares writing the records field by field (as done
+// in run_dma_multi_transfer_per_cb()) with gpiodma_encode_records().
+static void bench_encode_records() {
+  const int n = 16384;
+  uint32_t *levels = (uint32_t*) malloc(n * sizeof(*levels));
+  for (int i = 0; i < n; ++i) {
+    levels[i] = (i % 2 == 0) ? (1<<TOGGLE_GPIO) : 0;
+  }
+  const uint32_t mask = (1<<TOGGLE_GPIO);
+  struct UncachedMemBlock memblock
+    = alloc_block(n * sizeof(struct GPIORegData));
+  struct GPIORegData *out = (struct GPIORegData*) memblock.mem;
+
+  for (int method = 0; method < 2; ++method) {
+    uint64_t records = 0;
+    const uint32_t start_time = gpiodma_system_timer_usec();
+    uint32_t elapsed;
+    do {
+      if (method == 0) {
+        for (int i = 0; i < n; ++i) {
+          out[i].set = levels[i] & mask;
+          out[i].ignored_upper_set_bits = 0;
+          out[i].reserved_area = 0;
+          out[i].clr = ~levels[i] & mask;
+        }
+      } else {
+        gpiodma_encode_records(levels, n, mask, out);
+      }
+      records += n;
+      elapsed = gpiodma_system_timer_usec() - start_time;
+    } while (elapsed < BENCHMARK_WINDOW_USEC);
+
+    printf("E) %-40s %10.3f Mrecords/s %8.1f MByte/s\n",
+           method == 0 ? "Encode: field by field" :
+#ifdef HAVE_NEON
+           "Encode: gpiodma_encode_records() (NEON)",
+#else
+           "Encode: gpiodma_encode_records()",
+#endif
+           records / (double)elapsed,
+           records * sizeof(struct GPIORegData) / (double)elapsed);
+  }
+
+  UncachedMemBlock_free(&memblock);
+  free(levels);
+}
+
+// Run the benchmark for the given experiment, or all of them if 0.
+static int run_benchmarks(int experiment, const int *pins, int width) {
+  if (experiment == 21) {
+    bench_dma_sweep();   // Only CSV on stdout.
+    return 0;
+  }
+  printf("Benchmark on %s\n", board->name);
+  if (experiment == 0 || experiment == 1) bench_cpu_direct();
+  if (experiment == 0 || experiment == 2) bench_cpu_from_memory_masked();
+  if (experiment == 0 || experiment == 3) bench_cpu_from_memory_set_reset(0);
+  if (experiment == 0 || experiment == 4) bench_cpu_from_memory_set_reset(1);
+  if (experiment == 0 || experiment == 5) bench_dma_single_transfer_per_cb();
+  if (experiment == 0 || experiment == 6) {
+    // Compare the memory the DMA controller reads from, all else the same.
+    for (int i = 0; i < GPIODMA_NUM_MEM_POLICIES; ++i) {
+      if (board->is_bcm2711 && !gpiodma_mem_policies[i].bcm2711_ok) continue;
+      bench_dma_multi_transfer_per_cb(&gpiodma_mem_policies[i]);
+    }
+  }
+  if (dma4_available()) {
+    if (experiment == 0 || experiment == 5) bench_dma4_transfer(5);
+    if (experiment == 0 || experiment == 6) bench_dma4_transfer(6);
+  }
+  if (experiment == 0 || experiment == 9) bench_cpu_parallel_bus(pins, width);
+  if (experiment == 0 || experiment == 13) bench_dma_striped();
+  if (experiment == 0 || experiment == 17) bench_dma_stride_free();
+  if (experiment == 0 || experiment == 18) bench_cpu_kernels(experiment == 18);
+  if (experiment == 0) bench_encode_records();
+  if (experiment == 0) bench_alloc_batched();
+  return 0;
+}
+
+// Parse comma separated list of GPIO numbers into "pins". Returns number
+// of pins or -1 on error.
+static int parse_pin_list(const char *list, int *pins, int max_pins) {
+  int count = 0;
+  const char *pos = list;
+  while (*pos) {
+    char *end;
+    const long pin = strtol(pos, &end, 10);
+    if (end == pos || pin < 0 || pin > 27 || count >= max_pins)
+      return -1;
+    pins[count++] = (int)pin;
+    if (*end == ',') ++end;
+    else if (*end != '\0') return -1;
+    pos = end;
+  }
+  return count;
+}
+
+// Choose the memory policy of the given name for all DMA memory. Returns 0
+// if there is no such policy or it can't be used on this board.
+static int choose_mem_policy(const char *name) {
+  for (int i = 0; i < GPIODMA_NUM_MEM_POLICIES; ++i) {
+    if (strcmp(gpiodma_mem_policies[i].name, name) != 0) continue;
+    if (board->is_bcm2711 && !gpiodma_mem_policies[i].bcm2711_ok) {
+      fprintf(stderr, "Memory policy '%s' can't be used on %s\n",
+              name, board->name);
+      return 0;
+    }
+    gpiodma_set_mem_flags(gpiodma_mem_policies[i].mem_flags);
+    return 1;
+  }
+  fprintf(stderr, "Unknown memory policy '%s'\n", name);
+  return 0;
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage %s [-r] [-j] [-a] [-x] [-c <channel>] [-m <policy>] [-p <pins>] [1...23] [<sample-rate>]\n", prog);
+  fprintf(stderr, "      %s [-c <channel>] [-m <policy>] 15 <waveform-file>\n", prog);
+  fprintf(stderr, "      %s [-c <channel>] [-m <policy>] [-p <pins>] -d <socket>\n", prog);
+  fprintf(stderr, "      %s -s <socket> <waveform-file>\n", prog);
+  fprintf(stderr, "      %s -b [-c <channel>] [-m <policy>] [-p <pins>] [1...21]\n", prog);
+  fprintf(stderr, "Give number of test operation as argument to %s\n", prog);
+  fprintf(stderr, "With -b, measure the speed of the given test operation "
+          "(or all) instead of running it endlessly.\n");
+  fprintf(stderr, "With -r, run test operation 1 or 3 pinned to an isolated "
+          "core with realtime priority and report gaps between writes.\n");
+  fprintf(stderr, "With -j, report the jitter of the output: percentiles of "
+          "the time between edges, once a second.\n");
+  fprintf(stderr, "With -a, report the VC memory used per sample, and the "
+          "totals at exit.\n");
+  fprintf(stderr, "With -x, pace with a fractional clock divisor: closer to "
+          "<sample-rate> on average, but periods vary by a PLLD cycle.\n");
+  fprintf(stderr, "With -d, stay resident and play waveform files sent "
+          "with -s to the Unix socket; they may only use the pins given "
+          "with -p (default: %d).\n", TOGGLE_GPIO);
+  fprintf(stderr, "With -c, use the given DMA channel instead of the highest "
+          "free one the device tree allows. On a Pi 4, 5 and 6 use a DMA4 "
+          "channel 11..14 unless a legacy one 0..6 is given.\n");
+  fprintf(stderr, "With -m, choose how memory for DMA is allocated:\n");
+  for (int i = 0; i < GPIODMA_NUM_MEM_POLICIES; ++i) {
+    fprintf(stderr, "    %-9s %s\n", gpiodma_mem_policies[i].name,
+            gpiodma_mem_policies[i].description);
+  }
+  fprintf(stderr, "Test operation\n"
+          "== Baseline tests, using CPU directly ==\n"
+          "1 - CPU: Writing to GPIO directly in tight loop\n"
+          "2 - CPU: reading word from memory, write masked to GPIO set/clr.\n"
+          "3 - CPU: reading prepared set/clr from memory, write to GPIO.\n"
+          "4 - CPU: reading prepared set/clr from UNCACHED memory, write to GPIO.\n"
+          "18 - CPU: 2 to 4 with kernels specialized at compile time (benchmark only: -b 18).\n"
+          "\n== DMA tests, using DMA to pump data to ==\n"
+          "5 - DMA: Single control block per set/reset GPIO\n"
+          "6 - DMA: Sending a sequence of set/clear with one DMA control block and negative destination stride.\n"
+          "7 - DMA: Streaming changing data through a ring of control blocks, CPU refilling.\n"
+          "8 - DMA: Sending set/clear paced by PWM at <sample-rate> (default 100000).\n"
+          "23 - DMA: As 8, reporting the achieved rate against the system timer.\n"
+          "22 - DMA: Changing the waveform of 6 on the fly, without stopping the DMA.\n"
+          "17 - DMA: Layouts without destination stride (benchmark only: -b 17).\n"
+          "21 - DMA: Sweep of 2D transfer parameters, as CSV (benchmark only: -b 21).\n"
+          "13 - DMA: Aggregate rate striped across multiple DMA channels (benchmark only: -b 13).\n"
+          "\n== Parallel bus output ==\n"
+          "9 - CPU: counter on parallel bus, expanded with lookup table.\n"
+          "10 - DMA: counter on parallel bus, streamed.\n"
+          "    The bus pins are given with -p as comma separated GPIO numbers,\n"
+          "    lowest bit first (default: 4,17,18,27,22,23,24,25).\n"
+          "\n== Waveforms ==\n"
+          "11 - DMA: Sparse waveform compiled into a control block chain, paced at <sample-rate>.\n"
+          "12 - DMA: Long buffer, split into the least number of control blocks.\n"
+          "16 - DMA: Run-length encoded waveform decoded just in time, paced at <sample-rate>.\n"
+          "19 - Hybrid: Bursts sent by the CPU on an isolated core, the rest by DMA.\n"
+          "\n== Feeding from applications ==\n"
+          "14 - DMA: Producer thread feeding the DMA through a lock-free queue.\n"
+          "15 - DMA: Play <waveform-file>, streamed from disk (a demo is written if it doesn't exist).\n"
+          "\n== Input ==\n"
+          "20 - DMA: Logic analyzer capturing GPIO 0..31, paced at <sample-rate>.\n");
+  if (board) {
+    fprintf(stderr, "Running on %s, peripheral base 0x%08X\n",
+            board->name, board->peri_base);
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  int benchmark = 0;
+  int realtime = 0;
+  int jitter = 0;
+  const char *channel_arg = NULL;
+  const char *mem_policy = NULL;
+  const char *daemon_socket = NULL;
+  const char *submit_socket = NULL;
+  int pins_given = 0;
+  int bus_pins[PARALLEL_BUS_MAX_WIDTH];
+  int bus_width = sizeof(kDefaultBusPins) / sizeof(kDefaultBusPins[0]);
+  memcpy(bus_pins, kDefaultBusPins, sizeof(kDefaultBusPins));
+  int opt;
+  while ((opt = getopt(argc, argv, "abc:d:jm:p:rs:x")) != -1) {
+    switch (opt) {
+    case 'd':
+      daemon_socket = optarg;
+      break;
+    case 's':
+      submit_socket = optarg;
+      break;
+    case 'b':
+      benchmark = 1;
+      break;
+    case 'r':
+      realtime = 1;
+      break;
+    case 'j':
+      jitter = 1;
+      break;
+    case 'x':
+      fractional_pacing = 1;
+      pwm_pacing_set_fractional(1);
+      break;
+    case 'a':
+      report_memory = 1;
+      atexit(report_memory_at_exit);
+      break;
+    case 'c':
+      channel_arg = optarg;
+      break;
+    case 'm':
+      mem_policy = optarg;
+      break;
+    case 'p':
+      pins_given = 1;
+      bus_width = parse_pin_list(optarg, bus_pins, PARALLEL_BUS_MAX_WIDTH);
+      if (bus_width <= 0) {
+        fprintf(stderr, "Invalid pin list '%s'\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  const int args = argc - optind;
+
+  if (submit_socket) {
+    // Only talking to the daemon, no peripherals involved.
+    if (args != 1) return usage(argv[0]);
+    return submit_to_daemon(submit_socket, argv[optind]);
+  }
+
+  board = gpiodma_open();
+  if (!board) {
+    fprintf(stderr, "Can't access the peripherals; need to run as root.\n");
+    return 1;
+  }
+  if (channel_arg && dma_channel_request(atoi(channel_arg)) != 0) {
+    fprintf(stderr, "DMA channel needs to be a full channel 0..%d%s\n",
+            DMA_MAX_FULL_CHANNEL,
+            board->is_bcm2711 ? " or a DMA4 channel 11..14" : "");
+    return usage(argv[0]);
+  }
+  if (mem_policy && !choose_mem_policy(mem_policy)) {
+    return usage(argv[0]);
+  }
+
+  // Whatever happens from now on, don't leave a DMA channel running.
+  dma_cleanup_install();
+
+  if (daemon_socket) {
+    if (args != 0) return usage(argv[0]);
+    uint32_t allowed_pins = 1u << TOGGLE_GPIO;
+    if (pins_given) {
+      allowed_pins = 0;
+      for (int i = 0; i < bus_width; ++i) allowed_pins |= 1u << bus_pins[i];
+    }
+    return run_daemon(daemon_socket, allowed_pins);
+  }
+
+  if (benchmark) {
+    const int experiment = (args > 0) ? atoi(argv[optind]) : 0;
+    const int has_benchmark = ((experiment >= 0 && experiment <= 6) ||
+                               experiment == 9 || experiment == 13 ||
+                               experiment == 17 || experiment == 18 ||
+                               experiment == 21);
+    if (args > 1 || !has_benchmark) {
+      return usage(argv[0]);
+    }
+    return run_benchmarks(experiment, bus_pins, bus_width);
+  }
+
+  if (args < 1 || args > 2) {
+    return usage(argv[0]);
+  }
+  if (atoi(argv[optind]) == 15) {
+    if (args != 2) return usage(argv[0]);
+    run_dma_waveform_file(argv[optind + 1]);
+    return 0;
+  }
+  const double sample_rate = (args > 1) ? atof(argv[optind + 1]) : 100000;
+  if (sample_rate <= 0) {
+    return usage(argv[0]);
+  }
+
+  if (jitter) {
+    // The parallel bus experiments don't use the toggle pin; watch their
+    // lowest bit instead.
+    const int experiment = atoi(argv[optind]);
+    jitter_sampler_start((experiment == 9 || experiment == 10)
+                         ? bus_pins[0] : TOGGLE_GPIO);
+  }
+
+  if (realtime) {
+    const int experiment = atoi(argv[optind]);
+    if (experiment != 1 && experiment != 3) {
+      fprintf(stderr, "Realtime mode is only available for experiment 1 and 3\n");
+      return usage(argv[0]);
+    }
+    run_cpu_realtime(experiment);
+    return 0;
+  }
+
+  switch (atoi(argv[optind])) {
+  case 1:
+    run_cpu_direct();
+    break;
+  case 2:
+    run_cpu_from_memory_masked();
+    break;
+  case 3:
     run_cpu_from_memory_set_reset();
     break;
   case 4:
     run_cpu_from_uncached_memory_set_reset();
     break;
   case 5:
-    run_dma_single_transfer_per_cb();
+    if (dma4_available()) run_dma4_transfer(5);
+    else run_dma_single_transfer_per_cb();
     break;
   case 6:
-    run_dma_multi_transfer_per_cb();
+    if (dma4_available()) run_dma4_transfer(6);
+    else run_dma_multi_transfer_per_cb();
+    break;
+  case 7:
+    run_dma_stream();
+    break;
+  case 8:
+    run_dma_pwm_paced(sample_rate, 0);
+    break;
+  case 9:
+    run_cpu_parallel_bus(bus_pins, bus_width);
+    break;
+  case 10:
+    run_dma_parallel_bus(bus_pins, bus_width);
+    break;
+  case 11:
+    run_dma_compiled_waveform(sample_rate);
+    break;
+  case 12:
+    run_dma_long_buffer();
+    break;
+  case 14:
+    run_dma_queue_feed();
+    break;
+  case 16:
+    run_dma_rle_waveform(sample_rate);
+    break;
+  case 19:
+    run_hybrid();
+    break;
+  case 20:
+    run_dma_capture(sample_rate);
+    break;
+  case 22:
+    run_dma_loop_swap();
+    break;
+  case 23:
+    run_dma_pwm_paced(sample_rate, 1);
     break;
   default:
     return usage(argv[0]);
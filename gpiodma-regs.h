@@ -0,0 +1,197 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) 2015, Henner Zeller <h.zeller@acm.org>
+ * This is provided as-is to the public domain.
+ *
+ * Register-level definitions of the BCM2835/BCM2711 peripherals used by
+ * libgpiodma: GPIO, system timer, clock manager, PWM and DMA. These are the
+ * names of the datasheets, unprefixed, so gpiodma.h doesn't include this;
+ * only code that programs the hardware directly does, such as gpiodma.c and
+ * gpio-dma-test.c.
+ */
+#ifndef GPIODMA_REGS_H
+#define GPIODMA_REGS_H
+
+#include <stdint.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define HAVE_NEON 1
+#endif
+
+// The Pi version is detected at runtime (see gpiodma_open()). This
+// compile-time option is only the fallback if detection fails.
+#ifndef PI_VERSION
+#  define PI_VERSION 2
+#endif
+
+#define BCM2708_PI1_PERI_BASE  0x20000000
+#define BCM2709_PI2_PERI_BASE  0x3F000000
+#define BCM2711_PI4_PERI_BASE  0xFE000000
+
+// --- General, Pi-specific setup fallback.
+#if PI_VERSION == 1
+#  define DEFAULT_PERI_BASE BCM2708_PI1_PERI_BASE
+#elif PI_VERSION == 2 || PI_VERSION == 3
+#  define DEFAULT_PERI_BASE BCM2709_PI2_PERI_BASE
+#else
+#  define DEFAULT_PERI_BASE BCM2711_PI4_PERI_BASE
+#endif
+
+// Device tree node describing the mapping of the peripherals.
+#define DT_SOC_RANGES "/proc/device-tree/soc/ranges"
+
+// ---- GPIO specific defines
+#define GPIO_REGISTER_BASE 0x200000
+#define GPIO_SET_OFFSET 0x1C
+#define GPIO_CLR_OFFSET 0x28
+#define GPIO_LEV_OFFSET 0x34
+#define PHYSICAL_GPIO_BUS (0x7E000000 + GPIO_REGISTER_BASE)
+
+// ---- System timer: free running 1Mhz counter. BCM2835 ARM Peripherals 12.
+#define ST_BASE 0x003000
+#define ST_CLO  (0x04/4)
+#define PHYSICAL_ST_BUS (0x7E000000 + ST_BASE)
+
+// ---- Clock manager and PWM defines. PWM is only used to pace the DMA.
+// There is no good documentation of the clock manager in the BCM2835 ARM
+// Peripherals datasheet for the PWM clock, but it works the same as the
+// general purpose clocks documented in 6.3.
+#define CLK_BASE          0x101000
+#define CLK_PWMCTL        (0xa0/4)
+#define CLK_PWMDIV        (0xa4/4)
+#define CLK_PASSWD        (0x5a << 24)  // Needed for every write.
+#define CLK_CTL_BUSY      (1<<7)
+#define CLK_CTL_KILL      (1<<5)
+#define CLK_CTL_ENAB      (1<<4)
+#define CLK_CTL_SRC_PLLD  6
+#define CLK_CTL_MASH(x)   (((x)&0x3) << 9)  // Noise shaping, for DIVF.
+#define CLK_DIV_DIVI(x)   (((x)&0xfff) << 12)
+#define CLK_DIV_DIVF(x)   ((x)&0xfff)   // Fraction of the divisor in 1/4096.
+
+// PLLD is the clock source, its frequency differs between the Pi versions.
+#define BCM2835_PLLD_FREQ 500000000
+#define BCM2711_PLLD_FREQ 750000000
+
+// BCM2835 ARM Peripherals 9.6
+#define PWM_BASE          0x20C000
+#define PWM_CTL           (0x00/4)
+#define PWM_DMAC          (0x08/4)
+#define PWM_RNG1          (0x10/4)
+#define PWM_FIF1_OFFSET   0x18
+#define PHYSICAL_PWM_BUS  (0x7E000000 + PWM_BASE)
+
+#define PWM_CTL_CLRF1     (1<<6)
+#define PWM_CTL_USEF1     (1<<5)
+#define PWM_CTL_PWEN1     (1<<0)
+#define PWM_DMAC_ENAB     (1<<31)
+#define PWM_DMAC_PANIC(x) (((x)&0xff) << 8)
+#define PWM_DMAC_DREQ(x)  ((x)&0xff)
+
+// ---- DMA specific defines
+#define DMA_DEFAULT_CHANNEL 5  // Without device tree info: that usually is free.
+#define DMA_MAX_FULL_CHANNEL 6  // 0..6 are full channels; 7..14 are Lite,
+                                // on the BCM2711 only 7..10, see DMA4 below.
+#define DMA_NUM_CHANNELS  15
+#define DMA_BASE          0x007000
+
+// BCM2385 ARM Peripherals 4.2.1.2
+#define DMA_CB_TI_NO_WIDE_BURSTS (1<<26)
+#define DMA_CB_TI_PERMAP(x)      (((x)&0x1f) << 16)
+#define DMA_CB_TI_BURST_LENGTH(x) (((x)&0xf) << 12)
+#define DMA_CB_TI_SRC_WIDTH      (1<<9)   // 128 bit source reads.
+#define DMA_CB_TI_SRC_INC        (1<<8)
+#define DMA_CB_TI_DEST_DREQ      (1<<6)
+#define DMA_CB_TI_DEST_INC       (1<<4)
+#define DMA_CB_TI_WAIT_RESP      (1<<3)
+#define DMA_CB_TI_TDMODE         (1<<1)
+
+// Peripheral DREQ signals, to be used with DMA_CB_TI_PERMAP(); 4.2.1.3
+#define DMA_DREQ_PCM_TX          2
+#define DMA_DREQ_PWM             5
+
+#define DMA_CS_RESET    (1<<31)
+#define DMA_CS_ABORT    (1<<30)
+#define DMA_CS_DISDEBUG (1<<28)
+#define DMA_CS_END      (1<<1)
+#define DMA_CS_ACTIVE   (1<<0)
+
+#define DMA_CB_TXFR_LEN_YLENGTH(y) ((((y)-1)&0x3fff) << 16)
+#define DMA_CB_TXFR_LEN_XLENGTH(x) ((x)&0xffff)
+#define DMA_CB_STRIDE_D_STRIDE(x)  (((x)&0xffff) << 16)
+#define DMA_CB_STRIDE_S_STRIDE(x)  ((x)&0xffff)
+
+// Limits of what a single control block can transfer. 4.2.1.1
+#define DMA_CB_MAX_YLENGTH   16384        // 2D mode YLENGTH: 14 bits.
+#define DMA_CB_MAX_TXFR_LEN  0x3fffffff   // Bytes in 1D mode: 30 bits.
+
+#define DMA_CS_PRIORITY(x) (((x)&0xf) << 16)
+#define DMA_CS_PANIC_PRIORITY(x) (((x)&0xf) << 20)
+
+// ---- DMA4, the faster DMA engines of the BCM2711 (Pi 4), channels 11..14.
+// BCM2711 ARM Peripherals 4.5. They have the same place in the register
+// space as the legacy ones, but their own registers and control block
+// layout. Their addresses are 40 bit: the upper 8 bits go into the SRCI and
+// DESTI words. They don't go through the legacy bus aliases, but see the
+// full address map: memory at its physical address, the peripherals at
+// 0x4_7E000000 and up.
+#define DMA4_FIRST_CHANNEL  11
+#define DMA4_LAST_CHANNEL   14
+#define DMA4_DEFAULT_MASK   ((1<<12) | (1<<13))  // Usually free for Linux.
+#define DMA4_PERI_ADDR_HI   0x04         // Bits 39..32 of peripherals.
+
+#define DMA4_CS_HALT        (1<<31)
+#define DMA4_CS_ABORT       (1<<30)
+#define DMA4_CS_DISDEBUG    (1<<29)
+#define DMA4_CS_WAIT_FOR_OUTSTANDING_WRITES (1<<28)
+#define DMA4_CS_QOS(x)       (((x)&0xf) << 16)
+#define DMA4_CS_PANIC_QOS(x) (((x)&0xf) << 20)
+#define DMA4_CS_END         (1<<1)
+#define DMA4_CS_ACTIVE      (1<<0)
+#define DMA4_DEBUG_RESET    (1<<23)
+
+#define DMA4_TI_D_DREQ      (1<<15)
+#define DMA4_TI_S_DREQ      (1<<14)
+#define DMA4_TI_PERMAP(x)   (((x)&0x1f) << 9)
+#define DMA4_TI_WAIT_RESP   (1<<2)
+#define DMA4_TI_TDMODE      (1<<1)
+
+// Source and destination info words.
+#define DMA4_INFO_STRIDE(x)  (((x)&0xffff) << 16)   // 2D mode, signed.
+#define DMA4_INFO_SIZE_32    (0<<13)
+#define DMA4_INFO_SIZE_128   (2<<13)
+#define DMA4_INFO_INC        (1<<12)
+#define DMA4_INFO_BURST_LENGTH(x) (((x)&0xf) << 8)
+#define DMA4_INFO_ADDR_HI(x) ((x)&0xff)
+
+#define DMA4_LEN_YLENGTH(y) ((((y)-1)&0x3fff) << 16)
+#define DMA4_LEN_XLENGTH(x) ((x)&0xffff)
+
+// Control block addresses are given in units of 32 bytes.
+#define DMA4_CB_ADDR(phys)  ((phys) >> 5)
+
+// Documentation: BCM2835 ARM Peripherals @4.2.1.2
+struct dma_channel_header {
+  uint32_t cs;        // control and status.
+  uint32_t cblock;    // control block address.
+};
+
+// BCM2711 ARM Peripherals 4.5.2.2
+struct dma4_channel_header {
+  uint32_t cs;        // control and status.
+  uint32_t cb;        // control block address >> 5.
+  uint32_t pad;
+  uint32_t debug;
+};
+
+// 4.5.2.1
+struct dma4_cb {   // 32 bytes.
+  uint32_t ti;     // transfer information.
+  uint32_t src;    // source address, lower 32 bits.
+  uint32_t srci;   // source info: upper address bits, increment, stride.
+  uint32_t dst;    // destination address, lower 32 bits.
+  uint32_t dsti;   // destination info.
+  uint32_t length; // transfer length.
+  uint32_t next;   // next control block >> 5.
+  uint32_t pad;
+};
+
+#endif  // GPIODMA_REGS_H
@@ -0,0 +1,1354 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) 2015, Henner Zeller <h.zeller@acm.org>
+ * This is provided as-is to the public domain.
+ *
+ * libgpiodma; see gpiodma.h
+ */
+
+#define _GNU_SOURCE  // for syscall()
+
+#include "gpiodma.h"
+#include "gpiodma-regs.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef HAVE_NEON
+#  include <arm_neon.h>
+#endif
+
+// Physical Memory Allocation, from raspberrypi/userland demo.
+#include "mailbox.h"
+
+// The channels of the DMA controller that the firmware leaves to Linux; the
+// node is named differently depending on the kernel version.
+static const char *const kDTDmaChannelMask[] = {
+  "/proc/device-tree/soc/dma@7e007000/brcm,dma-channel-mask",
+  "/proc/device-tree/soc/dma-controller@7e007000/brcm,dma-channel-mask",
+};
+
+// The DMA4 channels of the BCM2711 have their own node in older kernels.
+static const char *const kDTDma4ChannelMask[] = {
+  "/proc/device-tree/soc/dma@7e007b00/brcm,dma-channel-mask",
+  "/proc/device-tree/soc/dma-controller@7e007b00/brcm,dma-channel-mask",
+};
+
+const struct MemPolicy gpiodma_mem_policies[GPIODMA_NUM_MEM_POLICIES] = {
+  { "l2", GPIODMA_MEM_FLAG_L1_NONALLOCATING, 0,
+    "Not allocating in L1, allocating in L2 (default, but Pi 4)" },
+  { "direct", GPIODMA_MEM_FLAG_DIRECT, 1,
+    "Direct uncached, 0xC alias (default on Pi 4)" },
+  { "coherent", GPIODMA_MEM_FLAG_COHERENT, 0,
+    "Non-allocating in L2, but coherent" },
+};
+static struct BoardInfo gpiodma_board;
+
+// Read the big endian 32 bit value at the given offset of the file.
+static uint32_t read_dt_word(const char *filename, off_t offset) {
+  uint8_t buf[4];
+  uint32_t result = 0;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+  if (pread(fd, buf, sizeof(buf), offset) == sizeof(buf)) {
+    result = buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+  }
+  close(fd);
+  return result;
+}
+
+// Find out which Pi we are running on from the peripheral base address in the
+// device tree, the same way bcm_host_get_peripheral_address() does it.
+// The "ranges" start with the bus address of the peripherals, followed by the
+// physical address; on the Pi 4 the latter is preceded by an extra 32 bit
+// word as it is a 64 bit address.
+static void board_detect() {
+  uint32_t peri_base = read_dt_word(DT_SOC_RANGES, 4);
+  if (peri_base == 0) peri_base = read_dt_word(DT_SOC_RANGES, 8);
+
+  switch (peri_base) {
+  case BCM2708_PI1_PERI_BASE:
+  case BCM2709_PI2_PERI_BASE:
+  case BCM2711_PI4_PERI_BASE:
+    break;
+  default:
+    fprintf(stderr, "Can't determine Pi version from %s; assuming "
+            "peripheral base 0x%08X as compiled in.\n",
+            DT_SOC_RANGES, DEFAULT_PERI_BASE);
+    peri_base = DEFAULT_PERI_BASE;
+  }
+
+  gpiodma_board.peri_base = peri_base;
+  gpiodma_board.is_bcm2711 = (peri_base == BCM2711_PI4_PERI_BASE);
+  if (gpiodma_board.is_bcm2711) {
+    gpiodma_board.name = "BCM2711 (Pi 4)";
+    gpiodma_board.plld_freq = BCM2711_PLLD_FREQ;
+    // The legacy DMA engines of the BCM2711 only see the SDRAM through the
+    // uncached 0xC0000000 alias; the L2 allocation flags make no sense here.
+    gpiodma_board.mem_flags = GPIODMA_MEM_FLAG_DIRECT;
+  } else {
+    gpiodma_board.name = (peri_base == BCM2708_PI1_PERI_BASE)
+      ? "BCM2835 (Pi 1)" : "BCM2836/7 (Pi 2 or 3)";
+    gpiodma_board.plld_freq = BCM2835_PLLD_FREQ;
+    gpiodma_board.mem_flags = GPIODMA_MEM_FLAG_L1_NONALLOCATING;
+  }
+}
+
+static int mbox_fd = -1;   // used internally by the UncachedMemBlock-functions.
+
+// Detect the board and open what we need: the mailbox for memory and the
+// peripheral registers. These are mapped right away, so that no function
+// using them later can fail. Returns NULL if anything is missing, typically
+// because we are not root.
+const struct BoardInfo *gpiodma_open(void) {
+  board_detect();
+  if (mbox_fd < 0) mbox_fd = mbox_open();
+  if (mbox_fd < 0) return NULL;
+  const off_t kRegisters[] = { GPIO_REGISTER_BASE, ST_BASE, DMA_BASE,
+                               CLK_BASE, PWM_BASE };
+  for (size_t i = 0; i < sizeof(kRegisters)/sizeof(kRegisters[0]); ++i) {
+    if (gpiodma_mmap_register(kRegisters[i]) == NULL) return NULL;
+  }
+  return &gpiodma_board;
+}
+
+// Memory policy for UncachedMemBlock_alloc() and UncachedMemPool_create().
+void gpiodma_set_mem_flags(uint32_t flags) {
+  gpiodma_board.mem_flags = flags;
+}
+static int mem_alloc_verbose = 1;  // Print each allocation.
+static struct UncachedMemStats mem_stats;
+
+// Print each allocation to stderr, or be quiet, e.g. while benchmarking.
+void UncachedMemBlock_set_verbose(int verbose) {
+  mem_alloc_verbose = verbose;
+}
+
+// Allocate "n" blocks of memory of the given sizes (each rounded up to the
+// next full page) with the given mailbox flags. The memory will be aligned on
+// a page boundary and zeroed out.
+// The mailbox calls for all blocks are batched: one round-trip to allocate
+// them, one to lock them, instead of two per block.
+// Returns 0 on success. On failure, e.g. if the VideoCore is out of memory,
+// returns -1 with nothing allocated and mem == NULL in all blocks.
+int UncachedMemBlock_alloc_many(struct UncachedMemBlock *blocks,
+                                const size_t *sizes, int n,
+                                uint32_t flags) {
+  memset(blocks, 0, n * sizeof(*blocks));
+  if (mbox_fd < 0) return -1;  // gpiodma_open() failed or wasn't called.
+  unsigned *page_sizes = (unsigned*) malloc(n * sizeof(unsigned));
+  unsigned *handles = (unsigned*) malloc(n * sizeof(unsigned));
+  unsigned *bus_addrs = (unsigned*) malloc(n * sizeof(unsigned));
+  int err = (page_sizes && handles && bus_addrs) ? 0 : -1;
+  for (int i = 0; i < n && !err; ++i) {
+    // Round up to next full page.
+    const size_t size = sizes[i];
+    page_sizes[i] = size % GPIODMA_PAGE_SIZE == 0
+      ? size : (size + GPIODMA_PAGE_SIZE) & ~(GPIODMA_PAGE_SIZE - 1);
+  }
+
+  const int tried_alloc = !err;  // Only then handles[] are valid.
+  if (!err) {
+    err = mem_alloc_batch(mbox_fd, n, page_sizes, GPIODMA_PAGE_SIZE,
+                          flags, handles);
+    if (!err) err = mem_lock_batch(mbox_fd, n, handles, bus_addrs);
+  }
+
+  for (int i = 0; i < n && !err; ++i) {
+    struct UncachedMemBlock *result = &blocks[i];
+    result->mem = mapmem(GPIODMA_BUS_TO_PHYS(bus_addrs[i]), page_sizes[i]);
+    if (result->mem == NULL) {
+      err = -1;
+      break;
+    }
+    result->size = page_sizes[i];
+    result->requested_size = sizes[i];
+    result->mem_handle = handles[i];
+    result->bus_addr = bus_addrs[i];
+    if (mem_alloc_verbose) {
+      fprintf(stderr, "Alloc: %6d bytes;  %p (bus=0x%08x, phys=0x%08x)\n",
+              (int)result->size, result->mem, result->bus_addr,
+              GPIODMA_BUS_TO_PHYS(result->bus_addr));
+    }
+    memset(result->mem, 0x00, result->size);
+  }
+
+  if (err) {
+    // Undo whatever got done: mapped, allocated, locked.
+    for (int i = 0; i < n; ++i) {
+      if (blocks[i].mem) unmapmem(blocks[i].mem, blocks[i].size);
+    }
+    memset(blocks, 0, n * sizeof(*blocks));
+    if (tried_alloc) {
+      int num_handles = 0;
+      for (int i = 0; i < n; ++i) {
+        if (handles[i]) handles[num_handles++] = handles[i];
+      }
+      if (num_handles > 0) mem_release_batch(mbox_fd, num_handles, handles);
+    }
+  } else {
+    for (int i = 0; i < n; ++i) {
+      ++mem_stats.live_blocks;
+      mem_stats.live_bytes += blocks[i].size;
+      mem_stats.requested_bytes += blocks[i].requested_size;
+    }
+    if (mem_stats.live_bytes > mem_stats.peak_bytes)
+      mem_stats.peak_bytes = mem_stats.live_bytes;
+  }
+  free(bus_addrs);
+  free(handles);
+  free(page_sizes);
+  return err;
+}
+
+// Allocate a block of memory of the given size (which is rounded up to the next
+// full page) with the given mailbox flags. The memory will be aligned on a
+// page boundary and zeroed out. On failure, mem is NULL.
+struct UncachedMemBlock UncachedMemBlock_alloc_with_flags(size_t size,
+                                                          uint32_t flags) {
+  struct UncachedMemBlock result;
+  UncachedMemBlock_alloc_many(&result, &size, 1, flags);
+  return result;
+}
+
+// Allocate a block with the memory policy of this board (or chosen with -m).
+struct UncachedMemBlock UncachedMemBlock_alloc(size_t size) {
+  return UncachedMemBlock_alloc_with_flags(size, gpiodma_board.mem_flags);
+}
+
+// Free "n" blocks previously allocated with UncachedMemBlock_alloc*(), with
+// a single round-trip to the mailbox for every 16 blocks.
+void UncachedMemBlock_free_many(struct UncachedMemBlock *blocks, int n) {
+  unsigned handles[16];
+  int num_handles = 0;
+  for (int i = 0; i < n; ++i) {
+    struct UncachedMemBlock *block = &blocks[i];
+    if (block->mem == NULL) continue;
+    assert(block->mem_handle != 0);  // Pool chunk ? Use UncachedMemPool_free()
+    unmapmem(block->mem, block->size);
+    handles[num_handles++] = block->mem_handle;
+    block->mem = NULL;
+    --mem_stats.live_blocks;
+    mem_stats.live_bytes -= block->size;
+    mem_stats.requested_bytes -= block->requested_size;
+    if (num_handles == 16) {
+      mem_release_batch(mbox_fd, num_handles, handles);
+      num_handles = 0;
+    }
+  }
+  if (num_handles > 0) mem_release_batch(mbox_fd, num_handles, handles);
+}
+
+// Free block previously allocated with UncachedMemBlock_alloc()
+void UncachedMemBlock_free(struct UncachedMemBlock *block) {
+  UncachedMemBlock_free_many(block, 1);
+}
+
+
+// Current use of VC memory.
+void UncachedMemBlock_get_stats(struct UncachedMemStats *stats) {
+  *stats = mem_stats;
+}
+
+void UncachedMemStats_print(const struct UncachedMemStats *stats) {
+  fprintf(stderr, "VC memory: %d blocks, %d bytes locked (%d requested, "
+          "%d lost to page rounding); peak %d bytes\n",
+          stats->live_blocks, (int)stats->live_bytes,
+          (int)stats->requested_bytes,
+          (int)(stats->live_bytes - stats->requested_bytes),
+          (int)stats->peak_bytes);
+}
+
+void DMAFootprint_print(const char *name, const struct DMAFootprint *fp) {
+  const int samples = fp->samples > 0 ? fp->samples : 1;
+  fprintf(stderr, "%s: %d samples; %d bytes control blocks + %d bytes payload "
+          "= %.1f bytes/sample; %d bytes locked = %.1f bytes/sample\n",
+          name, fp->samples, (int)fp->cb_bytes, (int)fp->payload_bytes,
+          (double)(fp->cb_bytes + fp->payload_bytes) / samples,
+          (int)fp->locked_bytes, (double)fp->locked_bytes / samples);
+}
+
+// Given a pointer to memory that is in the allocated block, return the
+// physical bus addresse needed by DMA operations.
+uintptr_t UncachedMemBlock_to_physical(const struct UncachedMemBlock *blk,
+                                       void *p) {
+    uint32_t offset = (uint8_t*)p - (uint8_t*)blk->mem;
+    assert(offset < blk->size);   // pointer not within our block.
+    return blk->bus_addr + offset;
+}
+
+// Make sure everything the CPU wrote to the memory range is in memory
+// before the DMA controller reads it. Our mapping of the memory via /dev/mem
+// is normally uncached for the CPU, but that depends on the kernel; so to be
+// safe when using memory the DMA controller sees through the L2 cache,
+// clean the CPU data cache for the range.
+void gpiodma_sync_for_dma(void *mem, size_t size) {
+  char *const start = (char*) mem;
+  char *const end = start + size;
+#if defined(__arm__) && defined(__ARM_NR_cacheflush)
+  syscall(__ARM_NR_cacheflush, start, end, 0);
+#elif defined(__aarch64__)
+  for (char *p = start; p < end; p += 64) {
+    asm volatile("dc cvac, %0" : : "r"(p) : "memory");  // Clean to PoC
+  }
+  asm volatile("dsb sy" : : : "memory");
+#else
+  (void)start; (void)end;
+#endif
+  __sync_synchronize();
+}
+
+// gpiodma_sync_for_dma() for the whole block.
+void UncachedMemBlock_sync_for_dma(const struct UncachedMemBlock *blk) {
+  gpiodma_sync_for_dma(blk->mem, blk->size);
+}
+
+// Allocate a pool with the given capacity (rounded up to the next full page)
+// and mailbox flags.
+struct UncachedMemPool UncachedMemPool_create_with_flags(size_t size,
+                                                         uint32_t flags) {
+  struct UncachedMemPool pool;
+  memset(&pool, 0, sizeof(pool));
+  pool.block = UncachedMemBlock_alloc_with_flags(size, flags);
+  return pool;
+}
+
+// Allocate a pool with the memory policy of this board (or chosen with -m).
+struct UncachedMemPool UncachedMemPool_create(size_t size) {
+  return UncachedMemPool_create_with_flags(size, gpiodma_board.mem_flags);
+}
+
+// Free the whole pool; all chunks handed out from it become invalid.
+void UncachedMemPool_destroy(struct UncachedMemPool *pool) {
+  UncachedMemBlock_free(&pool->block);
+  pool->used = 0;
+  memset(pool->free_list, 0, sizeof(pool->free_list));
+}
+
+// Size class for a chunk of the given size: chunk size is
+// GPIODMA_POOL_MIN_CHUNK << c
+static int UncachedMemPool_size_class(size_t size) {
+  if (size <= GPIODMA_POOL_MIN_CHUNK) return 0;
+  // Number of bits needed for size-1 is ceil(log2(size)).
+  return (32 - __builtin_clz((unsigned int)(size - 1))) - 5;
+}
+
+// Size of the chunk UncachedMemPool_alloc() hands out for a request of the
+// given size. Useful to size a pool for a known set of allocations.
+size_t UncachedMemPool_chunk_size(size_t size) {
+  return (size_t)GPIODMA_POOL_MIN_CHUNK << UncachedMemPool_size_class(size);
+}
+
+// Allocate a zeroed chunk of at least the given size from the pool. Returns
+// a block with mem == NULL if the pool is exhausted.
+struct UncachedMemBlock UncachedMemPool_alloc(struct UncachedMemPool *pool,
+                                              size_t size) {
+  struct UncachedMemBlock result;
+  memset(&result, 0, sizeof(result));
+  const int size_class = UncachedMemPool_size_class(size);
+  if (size_class >= GPIODMA_POOL_SIZE_CLASSES) {
+    fprintf(stderr, "Pool chunk too large: %d bytes\n", (int)size);
+    return result;
+  }
+  const size_t chunk_size = UncachedMemPool_chunk_size(size);
+
+  void *chunk = pool->free_list[size_class];
+  if (chunk != NULL) {
+    pool->free_list[size_class] = *(void**)chunk;  // Unlink from free list.
+  } else if (pool->used + chunk_size <= pool->block.size) {
+    chunk = (uint8_t*)pool->block.mem + pool->used;
+    pool->used += chunk_size;
+  } else {
+    fprintf(stderr, "Pool exhausted: can't allocate %d bytes\n", (int)size);
+    return result;
+  }
+
+  memset(chunk, 0x00, chunk_size);
+  result.mem = chunk;
+  result.bus_addr = UncachedMemBlock_to_physical(&pool->block, chunk);
+  result.mem_handle = 0;   // Not a mailbox allocation by itself.
+  result.size = chunk_size;
+  result.requested_size = size;
+  return result;
+}
+
+// Return a chunk previously allocated with UncachedMemPool_alloc()
+void UncachedMemPool_free(struct UncachedMemPool *pool,
+                          struct UncachedMemBlock *chunk) {
+  if (chunk->mem == NULL) return;
+  const int size_class = UncachedMemPool_size_class(chunk->size);
+  *(void**)chunk->mem = pool->free_list[size_class];
+  pool->free_list[size_class] = chunk->mem;
+  chunk->mem = NULL;
+}
+
+// Register pages mapped so far. Every subsystem (GPIO, DMA, system timer,
+// PWM, clock manager) is asked for by many functions, but each page of
+// registers is only mapped once, through the /dev/mem that mapmem() keeps
+// open for all mappings, including the ones of our DMA memory.
+#define PERI_MAP_CACHE_SIZE 16
+
+static struct {
+  off_t page_offset;   // Offset of the page relative to the peripheral base.
+  void *mem;
+} peri_map_cache[PERI_MAP_CACHE_SIZE];
+static int peri_map_count;
+static pthread_mutex_t peri_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Return a pointer to a periphery subsystem register, NULL if it can't be
+// mapped or the cache is full. Can't fail for the ones gpiodma_open() maps.
+void *gpiodma_mmap_register(off_t register_offset) {
+  const off_t page_offset = register_offset & ~(off_t)(GPIODMA_PAGE_SIZE - 1);
+  void *page = NULL;
+
+  pthread_mutex_lock(&peri_map_lock);  // Threads might ask for the timer.
+  for (int i = 0; i < peri_map_count && !page; ++i) {
+    if (peri_map_cache[i].page_offset == page_offset)
+      page = peri_map_cache[i].mem;
+  }
+  if (page == NULL && peri_map_count < PERI_MAP_CACHE_SIZE) {
+    page = mapmem(gpiodma_board.peri_base + page_offset, GPIODMA_PAGE_SIZE);
+    if (page != NULL) {
+      peri_map_cache[peri_map_count].page_offset = page_offset;
+      peri_map_cache[peri_map_count].mem = page;
+      ++peri_map_count;
+    }
+  }
+  pthread_mutex_unlock(&peri_map_lock);
+
+  if (page == NULL) return NULL;
+  return (char*)page + (register_offset - page_offset);
+}
+
+// Return the current value of the free running 1Mhz system timer.
+uint32_t gpiodma_system_timer_usec(void) {
+  static volatile uint32_t *timer = NULL;
+  if (timer == NULL) timer = gpiodma_mmap_register(ST_BASE);
+  return timer[ST_CLO];
+}
+
+void gpiodma_gpio_init_output(volatile uint32_t *gpio_registerset, int bit) {
+  *(gpio_registerset+(bit/10)) &= ~(7<<((bit%10)*3));  // prepare: set as input
+  *(gpio_registerset+(bit/10)) |=  (1<<((bit%10)*3));  // set as output.
+}
+
+// Encode GPIO levels into records to be sent by DMA: bits in "mask" that
+// are set in levels[i] are set, the other bits in "mask" cleared.
+//
+// "out" typically is uncached memory, in which every access goes straight
+// to DRAM. So we never write single fields, but put together full records
+// and write these with as wide stores as possible: with NEON, four records
+// are interleaved in registers and written with one vst4 (64 bytes).
+void gpiodma_encode_records(const uint32_t *levels, int n, uint32_t mask,
+                            struct GPIORegData *out) {
+  int i = 0;
+#ifdef HAVE_NEON
+  const uint32x4_t vmask = vdupq_n_u32(mask);
+  uint32x4x4_t records;
+  records.val[1] = vdupq_n_u32(0);   // ignored_upper_set_bits
+  records.val[2] = vdupq_n_u32(0);   // reserved_area
+  for (/**/; i + 4 <= n; i += 4) {
+    const uint32x4_t value = vld1q_u32(levels + i);
+    records.val[0] = vandq_u32(value, vmask);   // set
+    records.val[3] = vbicq_u32(vmask, value);   // clr = mask & ~value
+    vst4q_u32((uint32_t*)(out + i), records);
+  }
+#endif
+  for (/**/; i < n; ++i) {
+    const struct GPIORegData record = { levels[i] & mask, 0, 0,
+                                        ~levels[i] & mask };
+    out[i] = record;
+  }
+}
+
+// Return the header of the given DMA channel, NULL if there is no such one.
+volatile struct dma_channel_header *dma_channel_map(int channel_number) {
+  if (channel_number < 0 || channel_number >= DMA_NUM_CHANNELS) return NULL;
+  char *dmaBase = gpiodma_mmap_register(DMA_BASE);
+  // 4.2.1.2
+  return (volatile struct dma_channel_header*)(dmaBase + 0x100*channel_number);
+}
+
+// Channels we use, and thus possibly started; dma_cleanup() makes sure none
+// of them keeps running once we exit.
+static volatile struct dma_channel_header *dma_owned_channels[DMA_NUM_CHANNELS];
+
+// The registers dma_cleanup() needs besides the channels. It might run in a
+// signal handler, interrupting someone holding the lock in
+// gpiodma_mmap_register(), so they are mapped ahead of time, whenever a channel
+// is claimed or the pacing started.
+static volatile uint32_t *cleanup_timer;
+static volatile uint32_t *cleanup_clk;
+static volatile uint32_t *cleanup_pwm;
+
+static void dma_cleanup_map_registers() {
+  if (cleanup_timer) return;
+  cleanup_clk = gpiodma_mmap_register(CLK_BASE);
+  cleanup_pwm = gpiodma_mmap_register(PWM_BASE);
+  cleanup_timer = gpiodma_mmap_register(ST_BASE);  // Last: it marks all done.
+}
+
+// Return the header of the given DMA channel that we are going to use.
+volatile struct dma_channel_header *dma_channel_claim(int channel_number) {
+  if (channel_number < 0 || channel_number >= DMA_NUM_CHANNELS) return NULL;
+  dma_cleanup_map_registers();
+  if (!dma_owned_channels[channel_number])
+    dma_owned_channels[channel_number] = dma_channel_map(channel_number);
+  return dma_owned_channels[channel_number];
+}
+
+// Start the DMA channel working on the control block at the given bus
+// address, with the given AXI priority for normal and panic operation.
+void dma_channel_start_with_priority(
+  volatile struct dma_channel_header *channel, uint32_t cb_bus_addr,
+  int priority, int panic_priority) {
+  channel->cs |= DMA_CS_END;
+  channel->cblock = cb_bus_addr;
+  channel->cs = (DMA_CS_PRIORITY(priority) |
+                 DMA_CS_PANIC_PRIORITY(panic_priority) | DMA_CS_DISDEBUG);
+  channel->cs |= DMA_CS_ACTIVE;  // Aaaand action.
+}
+
+// Start the DMA channel working on the control block at the given bus address.
+void dma_channel_start(volatile struct dma_channel_header *channel,
+                       uint32_t cb_bus_addr) {
+  dma_channel_start_with_priority(channel, cb_bus_addr, 7, 7);
+}
+
+// Stop whatever the DMA channel is doing and reset it.
+void dma_channel_stop(volatile struct dma_channel_header *channel) {
+  channel->cs |= DMA_CS_ABORT;
+  usleep(100);
+  channel->cs &= ~DMA_CS_ACTIVE;
+  channel->cs |= DMA_CS_RESET;
+}
+
+// The PWM clock should stay well below what the PWM handles.
+#define PACING_MAX_PWM_CLOCK 25000000
+#define PACING_MAX_DIVI      4095
+#define PACING_FRACTIONAL_RANGES 64  // Ranges to try with a fractional divisor.
+
+static double rate_error(double rate, double sample_rate) {
+  return (rate > sample_rate) ? rate - sample_rate : sample_rate - rate;
+}
+
+// Find the clock divisor and PWM range that get closest to the sample rate.
+// With "fractional", the divisor may have a fraction (see PacingClock).
+struct PacingClock pacing_clock_plan(double sample_rate, int fractional) {
+  const double plld = gpiodma_board.plld_freq;
+  const uint32_t max_clock = PACING_MAX_PWM_CLOCK;
+  const uint32_t min_divi = (gpiodma_board.plld_freq + max_clock - 1)
+    / max_clock;
+  struct PacingClock best;
+  memset(&best, 0, sizeof(best));
+  best.requested_rate = sample_rate;
+
+  if (fractional) {
+    // In 1/4096 PLLD cycles, a sample takes divisor * range, and the closest
+    // divisor for a range is off by half of that at most: the smaller the
+    // range, the finer the steps. So start at the smallest range the divisor
+    // allows; a few more might round better. Whichever is chosen, the period
+    // only varies by one PLLD cycle with MASH.
+    const double period = plld * 4096 / sample_rate;
+    const double max_divisor = PACING_MAX_DIVI * 4096.0 + 4095;
+    double first = (double)(uint64_t)(period / max_divisor) + 1;
+    if (first < 2) first = 2;
+    for (int i = 0; i < PACING_FRACTIONAL_RANGES; ++i) {
+      if (first + i > UINT32_MAX) break;
+      const uint32_t range = (uint32_t)(first + i);
+      const uint64_t divisor = (uint64_t)(period / range + 0.5);
+      if (divisor > max_divisor) continue;
+      if (divisor < min_divi * 4096) break;  // PWM clock too fast from here.
+      const double rate = plld * 4096 / ((double)divisor * range);
+      const double error = rate_error(rate, sample_rate);
+      if (best.range == 0 || error < rate_error(best.rate, sample_rate)) {
+        best.divi = divisor / 4096;
+        best.divf = divisor % 4096;
+        best.range = range;
+        best.rate = rate;
+        if (error == 0) break;
+      }
+    }
+    if (best.range != 0) return best;
+    // Slower than the fraction can go; the integer divisor below might.
+  }
+
+  // Integer divisor: try them all, the range rounded for each.
+  for (uint32_t divi = min_divi; divi <= PACING_MAX_DIVI; ++divi) {
+    double range = (double)(uint64_t)(plld / divi / sample_rate + 0.5);
+    if (range < 2) range = 2;
+    if (range > UINT32_MAX) continue;
+    const double rate = plld / divi / range;
+    const double error = rate_error(rate, sample_rate);
+    if (best.range == 0 || error < rate_error(best.rate, sample_rate)) {
+      best.divi = divi;
+      best.range = (uint32_t)range;
+      best.rate = rate;
+    }
+  }
+  if (best.range == 0) {   // Slower than we can go.
+    best.divi = PACING_MAX_DIVI;
+    best.range = UINT32_MAX;
+    best.rate = plld / best.divi / best.range;
+  }
+  return best;
+}
+
+// Use the fractional divisor in pwm_pacing_start() (-x in gpio-dma-test).
+static int pacing_fractional = 0;
+void pwm_pacing_set_fractional(int fractional) {
+  pacing_fractional = fractional;
+}
+
+// So that dma_cleanup() knows to stop it.
+static volatile sig_atomic_t pwm_pacing_running;
+
+// Set up the PWM to request data from DMA at the given rate. We never send
+// the PWM output to any pin; we are only interested in the FIFO emptying at
+// a steady pace: a DMA transfer to the FIFO with DMA_CB_TI_DEST_DREQ set waits
+// until there is space, so it only finishes once every sample period.
+// Returns the achieved sample rate, which is the closest possible to the
+// requested one.
+double pwm_pacing_start(double sample_rate) {
+  const struct PacingClock clock
+    = pacing_clock_plan(sample_rate, pacing_fractional);
+  return pwm_pacing_start_clock(&clock);
+}
+
+// As pwm_pacing_start(), with the divisors already chosen.
+double pwm_pacing_start_clock(const struct PacingClock *clock) {
+  dma_cleanup_map_registers();
+  volatile uint32_t *clk = gpiodma_mmap_register(CLK_BASE);
+  volatile uint32_t *pwm = gpiodma_mmap_register(PWM_BASE);
+
+  // The MASH noise shaping can only be changed while the clock is stopped.
+  const uint32_t mash = clock->divf ? CLK_CTL_MASH(1) : 0;
+
+  pwm[PWM_CTL] = 0;                             // Stop PWM
+  usleep(10);
+  clk[CLK_PWMCTL] = CLK_PASSWD | CLK_CTL_KILL;  // Stop clock
+  while (clk[CLK_PWMCTL] & CLK_CTL_BUSY)
+    ;
+  clk[CLK_PWMDIV] = (CLK_PASSWD | CLK_DIV_DIVI(clock->divi) |
+                     CLK_DIV_DIVF(clock->divf));
+  clk[CLK_PWMCTL] = CLK_PASSWD | mash | CLK_CTL_SRC_PLLD;
+  clk[CLK_PWMCTL] = CLK_PASSWD | mash | CLK_CTL_SRC_PLLD | CLK_CTL_ENAB;
+  usleep(10);
+
+  pwm[PWM_RNG1] = clock->range;   // Each FIFO entry is sent in "range" cycles.
+  pwm[PWM_DMAC] = PWM_DMAC_ENAB | PWM_DMAC_PANIC(15) | PWM_DMAC_DREQ(15);
+  pwm[PWM_CTL] = PWM_CTL_CLRF1;                 // Clear FIFO
+  usleep(10);
+  pwm[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1; // Take data from FIFO; go.
+  pwm_pacing_running = 1;
+
+  return clock->rate;
+}
+
+// Stop PWM pacing started with pwm_pacing_start()
+void pwm_pacing_stop(void) {
+  volatile uint32_t *clk = gpiodma_mmap_register(CLK_BASE);
+  volatile uint32_t *pwm = gpiodma_mmap_register(PWM_BASE);
+  pwm[PWM_CTL] = 0;
+  pwm[PWM_DMAC] = 0;
+  clk[CLK_PWMCTL] = CLK_PASSWD | CLK_CTL_KILL;
+  pwm_pacing_running = 0;
+}
+
+// Start measuring the rate of something expected to run at "expected_rate",
+// e.g. the achieved rate of pwm_pacing_start(). Every "window_usec", the
+// rate of the last window is calculated.
+void RateMonitor_init(struct RateMonitor *monitor, double expected_rate,
+                      uint32_t window_usec) {
+  memset(monitor, 0, sizeof(*monitor));
+  monitor->expected_rate = expected_rate;
+  monitor->window_usec = window_usec;
+  monitor->last_usec = gpiodma_system_timer_usec();
+  monitor->window_start_usec = monitor->last_usec;
+}
+
+// Add the number of samples done since the last call. Needs to be called
+// more often than the system timer wraps (~71 minutes). Returns 1 if a
+// window is complete and "window_rate" has been updated.
+int RateMonitor_add(struct RateMonitor *monitor, uint32_t samples) {
+  const uint32_t now = gpiodma_system_timer_usec();
+  monitor->elapsed_usec += now - monitor->last_usec;
+  monitor->last_usec = now;
+  monitor->samples += samples;
+  if (monitor->elapsed_usec > 0)
+    monitor->rate = monitor->samples * 1e6 / monitor->elapsed_usec;
+
+  const uint32_t window = now - monitor->window_start_usec;
+  if (window < monitor->window_usec) return 0;
+  monitor->window_rate
+    = (monitor->samples - monitor->window_start_samples) * 1e6 / window;
+  monitor->window_start_usec = now;
+  monitor->window_start_samples = monitor->samples;
+  return 1;
+}
+
+// Deviation of "rate" from the expected rate in parts per million.
+double RateMonitor_ppm(const struct RateMonitor *monitor, double rate) {
+  return (rate / monitor->expected_rate - 1.0) * 1e6;
+}
+
+/* --------------------------------------------------------------------------
+ * Which DMA channel to use.
+ *
+ * Some DMA channels are used by the GPU firmware, the others are handed out
+ * by the kernel to drivers (SD card, SPI, audio ...) that need one. Which are
+ * which is in the channel mask in the device tree. The kernel allocates them
+ * from the lowest number upwards, so our best bet is the highest full channel
+ * in that mask that is idle right now.
+ * --------------------------------------------------------------------------
+ */
+
+// Channel chosen with dma_channel_request(), or -1 to discover one.
+static int dma_requested_channel = -1;
+
+// Use the given channel instead of discovering a free one, e.g. because the
+// user knows better (-c in gpio-dma-test).
+// On the BCM2711, this can also be one of the DMA4 channels. Returns -1 if
+// it is none of these.
+int dma_channel_request(int channel_number) {
+  if (!((channel_number >= 0 && channel_number <= DMA_MAX_FULL_CHANNEL) ||
+        (gpiodma_board.is_bcm2711 && channel_number >= DMA4_FIRST_CHANNEL &&
+         channel_number <= DMA4_LAST_CHANNEL))) {
+    return -1;
+  }
+  dma_requested_channel = channel_number;
+  return 0;
+}
+
+// Channels the kernel, and thus we, may use.
+uint32_t dma_channel_mask(void) {
+  for (size_t i = 0; i < sizeof(kDTDmaChannelMask)/sizeof(kDTDmaChannelMask[0]);
+       ++i) {
+    const uint32_t mask = read_dt_word(kDTDmaChannelMask[i], 0);
+    if (mask != 0) return mask;
+  }
+  return 1 << DMA_DEFAULT_CHANNEL;  // No device tree: hope for the best.
+}
+
+// A channel is idle if it is not active and not pointing to a control block.
+static int dma_channel_is_idle(int channel_number) {
+  volatile struct dma_channel_header *channel = dma_channel_map(channel_number);
+  return !(channel->cs & DMA_CS_ACTIVE) && channel->cblock == 0;
+}
+
+// Find up to "max" free full DMA channels, best candidates first. Returns
+// the number of channels found.
+int dma_find_free_channels(int *channels, int max) {
+  if (dma_requested_channel >= 0 && dma_requested_channel <= DMA_MAX_FULL_CHANNEL
+      && max > 0) {
+    channels[0] = dma_requested_channel;  // The user knows best.
+    return 1;
+  }
+  const uint32_t mask = dma_channel_mask();
+  int found = 0;
+  for (int c = DMA_MAX_FULL_CHANNEL; c >= 0 && found < max; --c) {
+    if ((mask & (1 << c)) == 0) continue;
+    if (!dma_channel_is_idle(c)) continue;
+    channels[found++] = c;
+  }
+  return found;
+}
+
+// Return the channel to use for the single channel experiments.
+// Returns -1 if there is no free one.
+int dma_channel_choose(void) {
+  static int chosen = -1;
+  if (chosen < 0 && dma_find_free_channels(&chosen, 1) == 0)
+    return -1;
+  return chosen;
+}
+
+/* --------------------------------------------------------------------------
+ * DMA4 channels of the BCM2711.
+ * --------------------------------------------------------------------------
+ */
+
+// DMA4 channels we use; kept apart, as they are stopped differently.
+static volatile struct dma4_channel_header *dma4_owned_channels[DMA_NUM_CHANNELS];
+
+// Use DMA4, unless we are not on a BCM2711 or a legacy channel was requested.
+int dma4_available(void) {
+  return gpiodma_board.is_bcm2711 &&
+    (dma_requested_channel < 0 || dma_requested_channel >= DMA4_FIRST_CHANNEL);
+}
+
+// Return the header of the given DMA4 channel that we are going to use.
+volatile struct dma4_channel_header *dma4_channel_claim(int channel_number) {
+  if (channel_number < DMA4_FIRST_CHANNEL ||
+      channel_number > DMA4_LAST_CHANNEL) {
+    return NULL;
+  }
+  dma_cleanup_map_registers();
+  if (!dma4_owned_channels[channel_number]) {
+    dma4_owned_channels[channel_number]
+      = (volatile struct dma4_channel_header*) dma_channel_map(channel_number);
+  }
+  return dma4_owned_channels[channel_number];
+}
+
+// Start the DMA4 channel on the control block at the given physical address.
+void dma4_channel_start(volatile struct dma4_channel_header *channel,
+                        uint32_t cb_phys_addr) {
+  channel->cs |= DMA4_CS_END;
+  channel->cb = DMA4_CB_ADDR(cb_phys_addr);
+  channel->cs = (DMA4_CS_QOS(7) | DMA4_CS_PANIC_QOS(7) | DMA4_CS_DISDEBUG |
+                 DMA4_CS_WAIT_FOR_OUTSTANDING_WRITES);
+  channel->cs |= DMA4_CS_ACTIVE;
+}
+
+// Stop whatever the DMA4 channel is doing and reset it.
+void dma4_channel_stop(volatile struct dma4_channel_header *channel) {
+  channel->cs |= DMA4_CS_ABORT;
+  usleep(100);
+  channel->cs &= ~DMA4_CS_ACTIVE;
+  channel->debug |= DMA4_DEBUG_RESET;
+}
+
+// DMA4 channels the kernel, and thus we, may use.
+static uint32_t dma4_channel_mask() {
+  for (size_t i = 0; i < sizeof(kDTDma4ChannelMask)/sizeof(kDTDma4ChannelMask[0]);
+       ++i) {
+    const uint32_t mask = read_dt_word(kDTDma4ChannelMask[i], 0);
+    if (mask != 0) return mask;
+  }
+  // Newer kernels have all channels in one node.
+  const uint32_t dma4_bits = ((1 << (DMA4_LAST_CHANNEL + 1)) - 1)
+    & ~((1 << DMA4_FIRST_CHANNEL) - 1);
+  const uint32_t mask = dma_channel_mask() & dma4_bits;
+  return mask ? mask : DMA4_DEFAULT_MASK;
+}
+
+// Return the DMA4 channel to use: the one requested, or the highest idle one.
+// Returns -1 if there is no free one.
+int dma4_channel_choose(void) {
+  static int chosen = -1;
+  if (chosen >= 0) return chosen;
+  if (dma_requested_channel >= DMA4_FIRST_CHANNEL) {
+    chosen = dma_requested_channel;
+    return chosen;
+  }
+  const uint32_t mask = dma4_channel_mask();
+  for (int c = DMA4_LAST_CHANNEL; c >= DMA4_FIRST_CHANNEL; --c) {
+    if ((mask & (1 << c)) == 0) continue;
+    volatile struct dma4_channel_header *channel
+      = (volatile struct dma4_channel_header*) dma_channel_map(c);
+    if (!(channel->cs & DMA4_CS_ACTIVE) && channel->cb == 0) {
+      chosen = c;
+      return chosen;
+    }
+  }
+  return -1;
+}
+
+// Wait by watching the system timer; unlike usleep(), this is fine in a
+// signal handler.
+static void dma_cleanup_busy_wait(uint32_t usec) {
+  const uint32_t start = cleanup_timer[ST_CLO];
+  while (cleanup_timer[ST_CLO] - start < usec)
+    ;
+}
+
+// Stop all DMA channels we touched and the PWM pacing. Registered to run
+// at exit and on fatal signals: a crash or Ctrl-C would otherwise leave the
+// DMA running forever, reading from memory that is not ours anymore.
+// To be async-signal-safe, this only uses registers mapped ahead of time
+// and plain register accesses: no locks, no library calls.
+static void dma_cleanup() {
+  if (!cleanup_timer) return;  // Nothing claimed, nothing started.
+  for (int c = 0; c < DMA_NUM_CHANNELS; ++c) {
+    volatile struct dma4_channel_header *dma4 = dma4_owned_channels[c];
+    volatile struct dma_channel_header *legacy = dma_owned_channels[c];
+    if (dma4 && (dma4->cs & DMA4_CS_ACTIVE)) {
+      dma4->cs |= DMA4_CS_ABORT;   // As dma4_channel_stop()
+      dma_cleanup_busy_wait(100);
+      dma4->cs &= ~DMA4_CS_ACTIVE;
+      dma4->debug |= DMA4_DEBUG_RESET;
+    } else if (legacy && (legacy->cs & DMA_CS_ACTIVE)) {
+      legacy->cs |= DMA_CS_ABORT;  // As dma_channel_stop()
+      dma_cleanup_busy_wait(100);
+      legacy->cs &= ~DMA_CS_ACTIVE;
+      legacy->cs |= DMA_CS_RESET;
+    }
+  }
+  if (pwm_pacing_running) {        // As pwm_pacing_stop()
+    cleanup_pwm[PWM_CTL] = 0;
+    cleanup_pwm[PWM_DMAC] = 0;
+    cleanup_clk[CLK_PWMCTL] = CLK_PASSWD | CLK_CTL_KILL;
+    pwm_pacing_running = 0;
+  }
+}
+
+static void dma_cleanup_signal_handler(int sig) {
+  dma_cleanup();
+  raise(sig);  // Handler was reset; terminate with the original signal.
+}
+
+void dma_cleanup_install(void) {
+  atexit(dma_cleanup);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = dma_cleanup_signal_handler;
+  sa.sa_flags = SA_RESETHAND;
+  sigemptyset(&sa.sa_mask);
+  // dma_cleanup() is async-signal-safe, so it can also run on crashes.
+  const int kFatalSignals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT,
+                                SIGSEGV, SIGBUS, SIGFPE, SIGABRT };
+  for (size_t i = 0; i < sizeof(kFatalSignals)/sizeof(kFatalSignals[0]); ++i) {
+    sigaction(kFatalSignals[i], &sa, NULL);
+  }
+}
+
+// Number of control blocks needed to send "n" records with
+// gpiodma_build_record_chain().
+int gpiodma_record_chain_length(int n) {
+  return (n + DMA_CB_MAX_YLENGTH - 1) / DMA_CB_MAX_YLENGTH;
+}
+
+// Set up a chain of control blocks in "cbs" (within cb_block) that sends the
+// "n" records (within data_block) to GPIO, as in
+// run_dma_multi_transfer_per_cb(). Switching control blocks costs time, so we
+// use as few as possible: each but the last one sends the maximum number of
+// records a single control block can, DMA_CB_MAX_YLENGTH. "cbs" needs to have
+// space for gpiodma_record_chain_length(n) control blocks. The last one
+// continues with the control block at bus address "next"; 0 to stop.
+// Returns -1 if there are no records.
+int gpiodma_build_record_chain(const struct UncachedMemBlock *cb_block,
+                               struct dma_cb *cbs,
+                               const struct UncachedMemBlock *data_block,
+                               struct GPIORegData *records, int n,
+                               uint32_t next) {
+  if (n <= 0) return -1;
+  const int num_cbs = gpiodma_record_chain_length(n);
+  for (int i = 0; i < num_cbs; ++i) {
+    const int first = i * DMA_CB_MAX_YLENGTH;
+    const int count = (n - first) > DMA_CB_MAX_YLENGTH
+      ? DMA_CB_MAX_YLENGTH : (n - first);
+    struct dma_cb *cb = &cbs[i];
+    cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
+                  DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_TDMODE);
+    cb->src    = UncachedMemBlock_to_physical(data_block, records + first);
+    cb->dst    = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
+    cb->length = (DMA_CB_TXFR_LEN_YLENGTH(count) |
+                  DMA_CB_TXFR_LEN_XLENGTH(sizeof(struct GPIORegData)));
+    cb->stride = DMA_CB_STRIDE_D_STRIDE(-16) | DMA_CB_STRIDE_S_STRIDE(0);
+    cb->next   = (i + 1 < num_cbs)
+      ? UncachedMemBlock_to_physical(cb_block, &cbs[i + 1])
+      : next;
+  }
+  return 0;
+}
+
+// Fill chunk "i" of the stream and set up its control block accordingly.
+static void DMAStream_fill_chunk(struct DMAStream *stream, int i) {
+  struct dma_cb *cb = (struct dma_cb*) stream->cb_block.mem + i;
+  struct GPIORegData *data
+    = (struct GPIORegData*) stream->data_block.mem + i * stream->chunk_records;
+  int n = stream->finished
+    ? 0 : stream->fill(stream->user_data, data, stream->chunk_records);
+  if (n > stream->chunk_records) n = 0;  // Broken fill(); better stop.
+
+  if (n <= 0) {
+    // End of stream. Make this the last control block: a single record that
+    // neither sets nor clears any bit, with no next control block to go to.
+    memset(data, 0x00, sizeof(*data));
+    n = 1;
+    cb->next = 0;
+    stream->finished = 1;
+  }
+  cb->length = DMA_CB_TXFR_LEN_YLENGTH(n) | DMA_CB_TXFR_LEN_XLENGTH(16);
+  gpiodma_sync_for_dma(data, n * sizeof(*data));
+  gpiodma_sync_for_dma(cb, sizeof(*cb));
+}
+
+// Prepare a stream on the given DMA channel with "num_chunks" chunks of up to
+// "chunk_records" records each. All chunks are filled, but the DMA is not
+// started yet.
+int DMAStream_init(struct DMAStream *stream, int channel_number,
+                   int num_chunks, int chunk_records,
+                   DMAStreamFillFun fill, void *user_data) {
+  memset(stream, 0, sizeof(*stream));
+  // Need at least one chunk to refill while one is sent.
+  if (num_chunks < 2 || chunk_records <= 0 ||
+      chunk_records > DMA_CB_MAX_YLENGTH) {
+    return -1;
+  }
+  stream->fill = fill;
+  stream->user_data = user_data;
+  stream->num_chunks = num_chunks;
+  stream->chunk_records = chunk_records;
+  stream->channel = dma_channel_claim(channel_number);
+  if (stream->channel == NULL) return -1;
+
+  const size_t cb_size = num_chunks * sizeof(struct dma_cb);
+  const size_t data_size = (size_t)num_chunks * chunk_records
+    * sizeof(struct GPIORegData);
+  stream->pool = UncachedMemPool_create(UncachedMemPool_chunk_size(cb_size) +
+                                        UncachedMemPool_chunk_size(data_size));
+  stream->cb_block = UncachedMemPool_alloc(&stream->pool, cb_size);
+  stream->data_block = UncachedMemPool_alloc(&stream->pool, data_size);
+  if (!stream->cb_block.mem || !stream->data_block.mem) {
+    UncachedMemPool_destroy(&stream->pool);
+    return -1;
+  }
+
+  // The static part of the control blocks: as in
+  // run_dma_multi_transfer_per_cb(), each record is written to GPIO set..clr,
+  // then the destination strides back to the set register. The next of the
+  // last control block loops back to the first.
+  struct dma_cb *cbs = (struct dma_cb*) stream->cb_block.mem;
+  struct GPIORegData *data = (struct GPIORegData*) stream->data_block.mem;
+  for (int i = 0; i < num_chunks; ++i) {
+    const uint32_t next
+      = UncachedMemBlock_to_physical(&stream->cb_block,
+                                     &cbs[(i + 1) % num_chunks]);
+    gpiodma_build_record_chain(&stream->cb_block, &cbs[i],
+                               &stream->data_block, data + i * chunk_records,
+                               chunk_records, next);
+  }
+
+  for (int i = 0; i < num_chunks; ++i) {
+    DMAStream_fill_chunk(stream, i);
+  }
+  return 0;
+}
+
+// Start sending the stream.
+void DMAStream_start(struct DMAStream *stream) {
+  stream->next_refill = 0;
+  dma_channel_start(stream->channel, stream->cb_block.bus_addr);
+}
+
+// Refill all chunks the DMA controller is done with. Needs to be called
+// often enough that the DMA doesn't come around to a chunk not refilled yet.
+// Returns the number of chunks refilled, or -1 once the end of the stream
+// has been sent and the DMA channel stopped.
+int DMAStream_refill(struct DMAStream *stream) {
+  const uint32_t active_cb = stream->channel->cblock;
+  const uint32_t cb_offset = active_cb - stream->cb_block.bus_addr;
+  if (active_cb == 0 || cb_offset >= stream->num_chunks*sizeof(struct dma_cb))
+    return stream->finished ? -1 : 0;
+  const int active = cb_offset / sizeof(struct dma_cb);
+
+  int refilled = 0;
+  while (stream->next_refill != active && !stream->finished) {
+    DMAStream_fill_chunk(stream, stream->next_refill);
+    stream->next_refill = (stream->next_refill + 1) % stream->num_chunks;
+    ++refilled;
+  }
+  return refilled;
+}
+
+// Memory used by the stream.
+void DMAStream_footprint(const struct DMAStream *stream,
+                         struct DMAFootprint *fp) {
+  fp->cb_bytes = stream->cb_block.requested_size;
+  fp->payload_bytes = stream->data_block.requested_size;
+  fp->locked_bytes = stream->pool.block.size;
+  fp->samples = stream->num_chunks * stream->chunk_records;
+}
+
+// Stop the DMA channel (if still running) and free the stream resources.
+void DMAStream_free(struct DMAStream *stream) {
+  dma_channel_stop(stream->channel);
+  UncachedMemPool_free(&stream->pool, &stream->cb_block);
+  UncachedMemPool_free(&stream->pool, &stream->data_block);
+  UncachedMemPool_destroy(&stream->pool);
+}
+
+// Prepare a loop on the given DMA channel for waveforms of up to
+// "max_records" records.
+int DMALoop_init(struct DMALoop *loop, int channel_number, int max_records) {
+  memset(loop, 0, sizeof(*loop));
+  if (max_records <= 0) return -1;
+  loop->max_records = max_records;
+  loop->channel = dma_channel_claim(channel_number);
+  if (loop->channel == NULL) return -1;
+  const size_t cb_size
+    = gpiodma_record_chain_length(max_records) * sizeof(struct dma_cb);
+  const size_t data_size = max_records * sizeof(struct GPIORegData);
+  loop->pool = UncachedMemPool_create(2 * UncachedMemPool_chunk_size(cb_size) +
+                                      2 * UncachedMemPool_chunk_size(data_size));
+  for (int b = 0; b < 2; ++b) {
+    loop->cb_block[b] = UncachedMemPool_alloc(&loop->pool, cb_size);
+    loop->data_block[b] = UncachedMemPool_alloc(&loop->pool, data_size);
+    if (!loop->cb_block[b].mem || !loop->data_block[b].mem) {
+      UncachedMemPool_destroy(&loop->pool);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Is the DMA working on a control block of buffer "b" ?
+static int DMALoop_in_buffer(const struct DMALoop *loop, int b) {
+  const uint32_t offset = loop->channel->cblock - loop->cb_block[b].bus_addr;
+  return offset < loop->num_cbs[b] * sizeof(struct dma_cb);
+}
+
+// Put the records into buffer "b" as a chain looping onto itself.
+static void DMALoop_fill(struct DMALoop *loop, int b,
+                         const struct GPIORegData *records, int n) {
+  struct GPIORegData *data = (struct GPIORegData*) loop->data_block[b].mem;
+  memcpy(data, records, n * sizeof(*records));
+  loop->num_cbs[b] = gpiodma_record_chain_length(n);
+  gpiodma_build_record_chain(&loop->cb_block[b],
+                             (struct dma_cb*) loop->cb_block[b].mem,
+                             &loop->data_block[b], data, n,
+                             loop->cb_block[b].bus_addr);
+  gpiodma_sync_for_dma(data, n * sizeof(*data));
+  gpiodma_sync_for_dma(loop->cb_block[b].mem,
+                       loop->num_cbs[b] * sizeof(struct dma_cb));
+}
+
+// Start looping over the given records.
+int DMALoop_start(struct DMALoop *loop,
+                  const struct GPIORegData *records, int n) {
+  if (n <= 0 || n > loop->max_records) return -1;
+  loop->active = 0;
+  DMALoop_fill(loop, 0, records, n);
+  dma_channel_start(loop->channel, loop->cb_block[0].bus_addr);
+  return 0;
+}
+
+// Switch to a new waveform once the DMA is through with the current round.
+// Returns 0 on success, or -1 if the DMA is still on the buffer needed:
+// the previous change has not taken effect yet. Try again a little later.
+// Also -1 if "n" is not 1 to max_records; that won't get better.
+int DMALoop_commit(struct DMALoop *loop,
+                   const struct GPIORegData *records, int n) {
+  const int next = 1 - loop->active;
+  if (n <= 0 || n > loop->max_records || DMALoop_in_buffer(loop, next))
+    return -1;
+  DMALoop_fill(loop, next, records, n);
+
+  // Everything is in memory; now the one write that splices it in.
+  struct dma_cb *cbs = (struct dma_cb*) loop->cb_block[loop->active].mem;
+  struct dma_cb *last = &cbs[loop->num_cbs[loop->active] - 1];
+  __sync_synchronize();
+  *(volatile uint32_t*)&last->next = loop->cb_block[next].bus_addr;
+  gpiodma_sync_for_dma(last, sizeof(*last));
+  loop->active = next;
+  return 0;
+}
+
+// Has the DMA switched to the waveform of the latest commit ?
+int DMALoop_switched(const struct DMALoop *loop) {
+  return DMALoop_in_buffer(loop, loop->active);
+}
+
+// Both buffers, as both are needed to change the waveform.
+void DMALoop_footprint(const struct DMALoop *loop, struct DMAFootprint *fp) {
+  fp->cb_bytes = 2 * loop->cb_block[0].requested_size;
+  fp->payload_bytes = 2 * loop->data_block[0].requested_size;
+  fp->locked_bytes = loop->pool.block.size;
+  fp->samples = loop->max_records;
+}
+
+// Stop the DMA and free the resources.
+void DMALoop_free(struct DMALoop *loop) {
+  dma_channel_stop(loop->channel);
+  for (int b = 0; b < 2; ++b) {
+    UncachedMemPool_free(&loop->pool, &loop->cb_block[b]);
+    UncachedMemPool_free(&loop->pool, &loop->data_block[b]);
+  }
+  UncachedMemPool_destroy(&loop->pool);
+}
+
+#define DMA_CAPTURE_LAPS 256  // Lap counter wraps after that many laps.
+
+// Prepare capturing "num_samples" samples into a ring on the given DMA
+// channel; with "timestamps", each sample also gets the system timer.
+int DMACapture_init(struct DMACapture *capture, int channel_number,
+                    int num_samples, int timestamps) {
+  memset(capture, 0, sizeof(*capture));
+  if (num_samples < 2) return -1;
+  capture->num_samples = num_samples;
+  capture->timestamps = timestamps;
+  capture->cbs_per_sample = timestamps ? 3 : 2;
+  const int num_sample_cbs = num_samples * capture->cbs_per_sample;
+  capture->num_cbs = num_sample_cbs + 2;
+  capture->channel = dma_channel_claim(channel_number);
+  if (capture->channel == NULL) return -1;
+
+  // Here, the CPU reads what the DMA wrote: so no L2 between the DMA and
+  // memory, or we might read stale data. Whatever the memory policy is.
+  const size_t cb_size = (size_t)capture->num_cbs * sizeof(struct dma_cb);
+  const size_t data_size = (num_samples * sizeof(struct DMACaptureSample) +
+                            (2 + DMA_CAPTURE_LAPS) * sizeof(uint32_t));
+  capture->pool = UncachedMemPool_create_with_flags(
+    UncachedMemPool_chunk_size(cb_size) + UncachedMemPool_chunk_size(data_size),
+    GPIODMA_MEM_FLAG_DIRECT);
+  capture->cb_block = UncachedMemPool_alloc(&capture->pool, cb_size);
+  capture->data_block = UncachedMemPool_alloc(&capture->pool, data_size);
+  if (!capture->cb_block.mem || !capture->data_block.mem) {
+    UncachedMemPool_destroy(&capture->pool);
+    return -1;
+  }
+
+  struct dma_cb *cbs = (struct dma_cb*) capture->cb_block.mem;
+  struct DMACaptureSample *samples
+    = (struct DMACaptureSample*) capture->data_block.mem;
+  uint32_t *fifo_word = (uint32_t*) (samples + num_samples);
+  uint32_t *lap_ptr = fifo_word + 1;
+  uint32_t *lap_table = lap_ptr + 1;
+  for (int i = 0; i < num_samples; ++i) {
+    struct dma_cb *cb = &cbs[i * capture->cbs_per_sample];
+
+    // Wait for the PWM to request data, then feed it one word; as in the
+    // paced output.
+    cb->info   = (DMA_CB_TI_PERMAP(DMA_DREQ_PWM) | DMA_CB_TI_DEST_DREQ |
+                  DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP);
+    cb->src    = UncachedMemBlock_to_physical(&capture->data_block, fifo_word);
+    cb->dst    = PHYSICAL_PWM_BUS + PWM_FIF1_OFFSET;
+    cb->length = 4;
+    ++cb;
+
+    // Then immediately copy the levels ...
+    cb->info   = DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP;
+    cb->src    = PHYSICAL_GPIO_BUS + GPIO_LEV_OFFSET;
+    cb->dst    = UncachedMemBlock_to_physical(&capture->data_block,
+                                              &samples[i].levels);
+    cb->length = 4;
+    ++cb;
+
+    // ... and the time.
+    if (timestamps) {
+      cb->info   = DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP;
+      cb->src    = PHYSICAL_ST_BUS + ST_CLO * sizeof(uint32_t);
+      cb->dst    = UncachedMemBlock_to_physical(&capture->data_block,
+                                                &samples[i].usec);
+      cb->length = 4;
+    }
+  }
+
+  // The lap counter. First copy the pointer into the source of the next
+  // control block ...
+  capture->lap_ptr = lap_ptr;
+  capture->lap_table_bus
+    = UncachedMemBlock_to_physical(&capture->data_block, lap_table);
+  for (int i = 0; i < DMA_CAPTURE_LAPS; ++i) {
+    lap_table[i] = capture->lap_table_bus
+      + ((i + 1) % DMA_CAPTURE_LAPS) * sizeof(uint32_t);
+  }
+  struct dma_cb *lap_cbs = &cbs[num_sample_cbs];
+  lap_cbs[0].info   = DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP;
+  lap_cbs[0].src    = UncachedMemBlock_to_physical(&capture->data_block,
+                                                   lap_ptr);
+  lap_cbs[0].dst    = UncachedMemBlock_to_physical(&capture->cb_block,
+                                                   &lap_cbs[1].src);
+  lap_cbs[0].length = 4;
+  // ... which then copies the table word it points to, the address of the
+  // next one, back into the pointer.
+  lap_cbs[1].info   = DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_WAIT_RESP;
+  lap_cbs[1].src    = capture->lap_table_bus;
+  lap_cbs[1].dst    = lap_cbs[0].src;
+  lap_cbs[1].length = 4;
+
+  for (int i = 0; i < capture->num_cbs; ++i) {
+    cbs[i].next = UncachedMemBlock_to_physical(
+      &capture->cb_block, &cbs[(i + 1) % capture->num_cbs]);
+  }
+  UncachedMemBlock_sync_for_dma(&capture->pool.block);
+  return 0;
+}
+
+// Start the PWM pacing at the given sample rate and the capture. Returns
+// the achieved sample rate.
+double DMACapture_start(struct DMACapture *capture, double sample_rate) {
+  capture->sample_rate = pwm_pacing_start(sample_rate);
+  *capture->lap_ptr = capture->lap_table_bus;
+  capture->read_lap = 0;
+  capture->read_pos = 0;
+  capture->last_drain_usec = gpiodma_system_timer_usec();
+  dma_channel_start(capture->channel, capture->cb_block.bus_addr);
+  return capture->sample_rate;
+}
+
+// Hand all samples captured since the last call to "fun". Needs to be called
+// before the DMA comes around the ring, otherwise samples are lost: that is
+// counted in "overruns". Returns the number of samples handed out.
+int DMACapture_drain(struct DMACapture *capture,
+                     DMACaptureFun fun, void *user_data) {
+  // Read the lap counter between two looks at the position: if the DMA got
+  // through the lap control blocks meanwhile, the lap might not match.
+  const uint32_t cbs_size = capture->num_cbs * sizeof(struct dma_cb);
+  const uint32_t before = capture->channel->cblock - capture->cb_block.bus_addr;
+  const uint32_t lap_addr = *capture->lap_ptr;
+  const uint32_t after = capture->channel->cblock - capture->cb_block.bus_addr;
+  if (before >= cbs_size || after >= cbs_size)
+    return 0;  // Not running.
+  const int cb_before = before / sizeof(struct dma_cb);
+  const int cb_after = after / sizeof(struct dma_cb);
+  if (cb_after < cb_before || cb_after >= capture->num_cbs - 2)
+    return 0;  // Counting a lap right now; next time.
+
+  // The sample the DMA is working on is not complete yet.
+  const int num_samples = capture->num_samples;
+  const int write_pos = cb_after / capture->cbs_per_sample;
+  const int lap = (lap_addr - capture->lap_table_bus) / sizeof(uint32_t);
+  const int64_t period = (int64_t)DMA_CAPTURE_LAPS * num_samples;
+  int64_t behind = ((int64_t)(lap - capture->read_lap) * num_samples
+                    + write_pos - capture->read_pos) % period;
+  if (behind < 0) behind += period;
+
+  // The lap counter itself wraps around; if it might have, the time since
+  // we last looked tells.
+  const uint32_t now = gpiodma_system_timer_usec();
+  const double elapsed_samples
+    = (now - capture->last_drain_usec) * 1e-6 * capture->sample_rate;
+  capture->last_drain_usec = now;
+  if (behind >= num_samples || elapsed_samples >= period - num_samples) {
+    // Whatever we didn't drain got overwritten; take what is left.
+    ++capture->overruns;
+    behind = num_samples - 1;
+  }
+
+  const struct DMACaptureSample *samples
+    = (const struct DMACaptureSample*) capture->data_block.mem;
+  int pos = (write_pos - (int)behind + num_samples) % num_samples;
+  int n = (int)behind;
+  int drained = 0;
+  if (pos + n > num_samples) {
+    const int until_end = num_samples - pos;
+    fun(user_data, samples + pos, until_end);
+    drained += until_end;
+    n -= until_end;
+    pos = 0;
+  }
+  if (n > 0) {
+    fun(user_data, samples + pos, n);
+    drained += n;
+  }
+  capture->read_lap = lap;
+  capture->read_pos = write_pos;
+  return drained;
+}
+
+// Memory used by the capture.
+void DMACapture_footprint(const struct DMACapture *capture,
+                          struct DMAFootprint *fp) {
+  fp->cb_bytes = capture->cb_block.requested_size;
+  fp->payload_bytes = capture->data_block.requested_size;
+  fp->locked_bytes = capture->pool.block.size;
+  fp->samples = capture->num_samples;
+}
+
+// Stop the capture and free its resources.
+void DMACapture_free(struct DMACapture *capture) {
+  dma_channel_stop(capture->channel);
+  pwm_pacing_stop();
+  UncachedMemPool_free(&capture->pool, &capture->cb_block);
+  UncachedMemPool_free(&capture->pool, &capture->data_block);
+  UncachedMemPool_destroy(&capture->pool);
+}
@@ -0,0 +1,407 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) 2015, Henner Zeller <h.zeller@acm.org>
+ * This is provided as-is to the public domain.
+ *
+ * libgpiodma: the building blocks of gpio-dma-test, for use in other
+ * programs: uncached memory for the DMA controller, DMA channels, pacing,
+ * streaming records to GPIO.
+ *
+ * Call gpiodma_open() first; it finds out which Pi we are running on, which
+ * everything else depends on. Most functions need root to access /dev/mem.
+ * Nothing in here exits: failures, including arguments out of range such as
+ * a channel number, are returned as -1, NULL or a block with mem == NULL,
+ * and left to the caller to report. Only misuse that can't be told from the
+ * values, such as a pointer outside of its block or a pool chunk given to
+ * UncachedMemBlock_free(), is caught with assert().
+ *
+ * Names are prefixed per module (UncachedMem*, dma_channel_*, pwm_pacing_*,
+ * DMAStream_*, ..., and gpiodma_ for the rest) rather than living in one
+ * namespace. The unprefixed register-level macros and hardware structs are
+ * in gpiodma-regs.h, which this header doesn't include.
+ */
+#ifndef GPIODMA_H
+#define GPIODMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define GPIODMA_PAGE_SIZE 4096
+
+// ---- Memory mappping defines
+#define GPIODMA_BUS_TO_PHYS(x) ((x)&~0xC0000000)
+
+// ---- Memory allocating defines
+// https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
+#define GPIODMA_MEM_FLAG_DIRECT           (1 << 2)
+#define GPIODMA_MEM_FLAG_COHERENT         (2 << 2)
+#define GPIODMA_MEM_FLAG_L1_NONALLOCATING \
+  (GPIODMA_MEM_FLAG_DIRECT | GPIODMA_MEM_FLAG_COHERENT)
+
+// Allocation policies to choose from with -m: they determine through which
+// bus address alias, and so which caches, the DMA controller sees memory.
+struct MemPolicy {
+  const char *name;
+  uint32_t mem_flags;
+  int bcm2711_ok;          // The legacy DMA of BCM2711 only sees 0xC alias.
+  const char *description;
+};
+#define GPIODMA_NUM_MEM_POLICIES 3
+extern const struct MemPolicy gpiodma_mem_policies[GPIODMA_NUM_MEM_POLICIES];
+
+// Register-level definitions, including the channel headers and the
+// DMA4 control blocks, are in gpiodma-regs.h.
+struct dma_channel_header;
+struct dma4_channel_header;
+
+// A control block of the legacy DMA engines; BCM2835 ARM Peripherals
+// 4.2.1.1. Public, as gpiodma_build_record_chain() fills these in.
+struct dma_cb {    // 32 bytes.
+  uint32_t info;   // transfer information.
+  uint32_t src;    // physical source address.
+  uint32_t dst;    // physical destination address.
+  uint32_t length; // transfer length.
+  uint32_t stride; // stride mode.
+  uint32_t next;   // next control block; Physical address. 32 byte aligned.
+  uint32_t pad[2];
+};
+
+// Properties of the board we are running on, as found by gpiodma_open().
+struct BoardInfo {
+  const char *name;
+  uint32_t peri_base;    // Physical address of peripherals as seen by the ARM.
+  uint32_t plld_freq;    // Frequency of PLLD, the clock source for pacing.
+  uint32_t mem_flags;    // Mailbox flags to allocate memory for DMA.
+  int is_bcm2711;        // Pi 4 has a different SoC with its own quirks.
+};
+
+// A memory block that represents memory that is allocated in physical
+// memory and locked there so that it is not swapped out.
+// It is not backed by any L1 or L2 cache, so writing to it will directly
+// modify the physical memory (and it is slower of course to do so).
+// This is memory needed with DMA applications so that we can write through
+// with the CPU and have the DMA controller 'see' the data.
+// The UncachedMemBlock_{alloc,free,to_physical}
+// functions are meant to operate on these.
+struct UncachedMemBlock {
+  void *mem;                  // User visible value: the memory to use.
+  //-- Internal representation.
+  uint32_t bus_addr;
+  uint32_t mem_handle;
+  size_t size;
+  size_t requested_size;      // Before rounding to pages (or pool chunks).
+};
+
+// VC memory currently allocated with UncachedMemBlock_alloc*(); this memory
+// is locked and contiguous, so a scarce resource. See
+// UncachedMemBlock_get_stats().
+struct UncachedMemStats {
+  int live_blocks;
+  size_t live_bytes;          // Locked, i.e. rounded up to full pages.
+  size_t requested_bytes;     // What was asked for, of these.
+  size_t peak_bytes;          // Maximum of live_bytes so far.
+};
+
+// Memory footprint of one of the output (or input) engines: control
+// blocks vs. payload, and what that means per sample.
+struct DMAFootprint {
+  size_t cb_bytes;            // Control blocks.
+  size_t payload_bytes;       // Data sent or received.
+  size_t locked_bytes;        // VC memory allocated for both, incl. rounding.
+  int samples;                // Samples held in that memory.
+};
+
+// A pool of uncached memory. Each UncachedMemBlock_alloc() is a full mailbox
+// round-trip and uses at least a full page, which is wasteful if we need many
+// small blocks such as dma_cb or short payloads. The pool allocates one large
+// block up-front and hands out chunks of it.
+//
+// Chunk sizes are rounded up to a power of two, starting at 32 bytes, so all
+// chunks are aligned suitably for a dma_cb. Freed chunks are kept in a free
+// list per size class, so both UncachedMemPool_alloc() and
+// UncachedMemPool_free() are O(1).
+//
+// Chunks are handed out as UncachedMemBlock, so UncachedMemBlock_to_physical()
+// works on them as usual. They must be returned with UncachedMemPool_free(),
+// not UncachedMemBlock_free().
+#define GPIODMA_POOL_MIN_CHUNK     32  // Smallest chunk; dma_cb alignment.
+#define GPIODMA_POOL_SIZE_CLASSES  24  // 32 bytes ... 256MiB.
+
+struct UncachedMemPool {
+  struct UncachedMemBlock block;   // The one big block we carve chunks from.
+  size_t used;                     // Bytes handed out from the block so far.
+  // Freed chunks, linked through their mem.
+  void *free_list[GPIODMA_POOL_SIZE_CLASSES];
+};
+
+// Layout of data that mimicks the GPIO registers from set to clr, so that
+// one record can be sent to GPIO with a single 16 byte DMA transfer; see
+// run_dma_multi_transfer_per_cb() for details.
+struct GPIORegData {
+  uint32_t set;
+  uint32_t ignored_upper_set_bits; // bits 33..54 of GPIO. Not needed.
+  uint32_t reserved_area;          // gap between GPIO registers.
+  uint32_t clr;
+};
+
+// Pre-expanded set and clr words for the CPU to write to GPIO.
+struct GPIOSetClr {
+  uint32_t set;
+  uint32_t clr;
+};
+
+/* --------------------------------------------------------------------------
+ * DMA streaming engine.
+ *
+ * The run_dma_* experiments loop over one fixed buffer. For continuous output
+ * of new data, the DMAStream keeps a ring of chunks, each described by one
+ * control block (layout as in run_dma_multi_transfer_per_cb()), whose 'next'
+ * points to the control block of the following chunk.
+ *
+ * While the DMA controller works on one chunk, the CPU refills the chunks
+ * the DMA controller already left behind. Progress is detected by looking at
+ * the control block address the channel is currently working on.
+ * --------------------------------------------------------------------------
+ */
+
+// Callback filling the next chunk of records to be sent. Writes up to
+// "max_records" records to "data" and returns the number written. Returning
+// 0 signals the end of the stream; so does returning more than max_records.
+typedef int (*DMAStreamFillFun)(void *user_data,
+                                struct GPIORegData *data, int max_records);
+
+struct DMAStream {
+  DMAStreamFillFun fill;
+  void *user_data;
+  int num_chunks;               // Number of chunks in the ring.
+  int chunk_records;            // Maximum number of records per chunk.
+
+  //-- Internal representation.
+  volatile struct dma_channel_header *channel;
+  struct UncachedMemPool pool;
+  struct UncachedMemBlock cb_block;    // num_chunks control blocks.
+  struct UncachedMemBlock data_block;  // num_chunks * chunk_records records.
+  int next_refill;              // Next chunk to refill once the DMA left it.
+  int finished;                 // fill() signalled the end of the stream.
+};
+
+/* --------------------------------------------------------------------------
+ * Changing a looping waveform without stopping the DMA.
+ *
+ * The DMALoop has two buffers, each with a chain of control blocks sending
+ * its records whose last control block loops back to the first. The DMA
+ * loops over the active one; a new waveform is prepared in the other, then
+ * spliced in by pointing the 'next' of the last control block of the active
+ * chain to the first of the new one. That is a single aligned 32 bit write,
+ * so the DMA either still sees the old 'next' and does one more round of the
+ * old waveform, or the new one; it switches at the end of a round either way,
+ * without stopping. Once the DMA has moved on, the old buffer is free for
+ * the next change.
+ * --------------------------------------------------------------------------
+ */
+struct DMALoop {
+  int max_records;              // Maximum records per waveform.
+
+  //-- Internal representation.
+  volatile struct dma_channel_header *channel;
+  struct UncachedMemPool pool;
+  struct UncachedMemBlock cb_block[2];
+  struct UncachedMemBlock data_block[2];
+  int num_cbs[2];
+  int active;                   // Buffer with the latest waveform.
+};
+
+/* --------------------------------------------------------------------------
+ * DMA input capture.
+ *
+ * The other direction: the DMA controller copies the GPIO level register
+ * GPLEV0, and optionally the system timer, into a ring of samples, paced by
+ * the PWM as in the output. The CPU drains the samples the DMA has written
+ * whenever it gets around to it; polling GPLEV itself would need a full core.
+ *
+ * To find out if the CPU fell a whole ring behind, the DMA also counts its
+ * laps around the ring. It can't add, but it can follow a linked list: each
+ * word of a table holds the address of the next one, and two control blocks
+ * at the end of the ring advance a pointer by one word.
+ * --------------------------------------------------------------------------
+ */
+struct DMACaptureSample {
+  uint32_t levels;   // GPLEV0: GPIO 0..31
+  uint32_t usec;     // System timer when sampled; only with timestamps.
+};
+
+// Callback receiving "n" captured "samples". There might be two calls per
+// drain when the ring wraps around.
+typedef void (*DMACaptureFun)(void *user_data,
+                              const struct DMACaptureSample *samples, int n);
+
+struct DMACapture {
+  int num_samples;              // Number of samples in the ring.
+  int timestamps;               // Also capture the system timer.
+  double sample_rate;           // As achieved by the PWM.
+  uint32_t overruns;            // Times the DMA came around before we drained.
+
+  //-- Internal representation.
+  volatile struct dma_channel_header *channel;
+  int cbs_per_sample;
+  int num_cbs;                  // Sample control blocks plus the lap counter.
+  struct UncachedMemPool pool;
+  struct UncachedMemBlock cb_block;
+  struct UncachedMemBlock data_block;  // Samples, FIFO word, lap counter.
+  volatile uint32_t *lap_ptr;   // Written by the DMA: into the lap table.
+  uint32_t lap_table_bus;       // Bus address of the lap table.
+  int read_lap;                 // Lap and sample to drain next.
+  int read_pos;
+  uint32_t last_drain_usec;
+};
+
+/* --------------------------------------------------------------------------
+ * Pacing rate control.
+ *
+ * The PWM clock is PLLD divided by DIVI + DIVF/4096, and the PWM asks for a
+ * sample every "range" of its clock cycles. With an integer divisor, every
+ * sample period is exactly the same number of PLLD cycles, but only rates
+ * that divide PLLD are possible. With the fractional divisor, the clock
+ * manager alternates between DIVI and DIVI+1 (MASH), which gets the average
+ * rate much closer, at the cost of periods varying by one PLLD cycle.
+ *
+ * What the DMA achieves can still be less: if it can't keep up, e.g. due to
+ * contention on the bus, the PWM just waits. The RateMonitor measures the
+ * samples actually done against the system timer.
+ * --------------------------------------------------------------------------
+ */
+struct PacingClock {
+  double requested_rate;
+  double rate;           // What the divisors give.
+  uint32_t divi;         // Integer part of the clock divisor.
+  uint32_t divf;         // Fractional part in 1/4096; 0 if integer only.
+  uint32_t range;        // PWM clock cycles per sample.
+};
+
+struct RateMonitor {
+  double expected_rate;
+  uint32_t window_usec;         // Length of a measurement window.
+  uint64_t samples;             // Samples done since start.
+  uint64_t elapsed_usec;        // Time since start.
+  double window_rate;           // Rate achieved in the last full window.
+  double rate;                  // Rate achieved since start.
+
+  //-- Internal representation.
+  uint32_t last_usec;
+  uint32_t window_start_usec;
+  uint64_t window_start_samples;
+};
+
+// -- Board
+
+// Detect the board we are running on and open the mailbox and the
+// peripherals. Needs to be called before anything else. Returns NULL on
+// failure, e.g. if not run as root.
+const struct BoardInfo *gpiodma_open(void);
+void gpiodma_set_mem_flags(uint32_t flags);
+
+// -- Uncached memory
+void UncachedMemBlock_set_verbose(int verbose);
+int UncachedMemBlock_alloc_many(struct UncachedMemBlock *blocks,
+                                const size_t *sizes, int n, uint32_t flags);
+struct UncachedMemBlock UncachedMemBlock_alloc_with_flags(size_t size,
+                                                          uint32_t flags);
+struct UncachedMemBlock UncachedMemBlock_alloc(size_t size);
+void UncachedMemBlock_free_many(struct UncachedMemBlock *blocks, int n);
+void UncachedMemBlock_free(struct UncachedMemBlock *block);
+uintptr_t UncachedMemBlock_to_physical(const struct UncachedMemBlock *blk,
+                                       void *p);
+void gpiodma_sync_for_dma(void *mem, size_t size);
+void UncachedMemBlock_sync_for_dma(const struct UncachedMemBlock *blk);
+void UncachedMemBlock_get_stats(struct UncachedMemStats *stats);
+void UncachedMemStats_print(const struct UncachedMemStats *stats);
+void DMAFootprint_print(const char *name, const struct DMAFootprint *fp);
+
+struct UncachedMemPool UncachedMemPool_create_with_flags(size_t size,
+                                                         uint32_t flags);
+struct UncachedMemPool UncachedMemPool_create(size_t size);
+void UncachedMemPool_destroy(struct UncachedMemPool *pool);
+size_t UncachedMemPool_chunk_size(size_t size);
+struct UncachedMemBlock UncachedMemPool_alloc(struct UncachedMemPool *pool,
+                                              size_t size);
+void UncachedMemPool_free(struct UncachedMemPool *pool,
+                          struct UncachedMemBlock *chunk);
+
+// -- Peripherals
+void *gpiodma_mmap_register(off_t register_offset);
+uint32_t gpiodma_system_timer_usec(void);
+void gpiodma_gpio_init_output(volatile uint32_t *gpio_registerset, int bit);
+void gpiodma_encode_records(const uint32_t *levels, int n, uint32_t mask,
+                            struct GPIORegData *out);
+
+// -- DMA channels and pacing
+volatile struct dma_channel_header *dma_channel_map(int channel_number);
+volatile struct dma_channel_header *dma_channel_claim(int channel_number);
+void dma_channel_start_with_priority(
+  volatile struct dma_channel_header *channel, uint32_t cb_bus_addr,
+  int priority, int panic_priority);
+void dma_channel_start(volatile struct dma_channel_header *channel,
+                       uint32_t cb_bus_addr);
+void dma_channel_stop(volatile struct dma_channel_header *channel);
+
+struct PacingClock pacing_clock_plan(double sample_rate, int fractional);
+void pwm_pacing_set_fractional(int fractional);
+double pwm_pacing_start(double sample_rate);
+double pwm_pacing_start_clock(const struct PacingClock *clock);
+void pwm_pacing_stop(void);
+
+void RateMonitor_init(struct RateMonitor *monitor, double expected_rate,
+                      uint32_t window_usec);
+int RateMonitor_add(struct RateMonitor *monitor, uint32_t samples);
+double RateMonitor_ppm(const struct RateMonitor *monitor, double rate);
+
+int dma_channel_request(int channel_number);
+uint32_t dma_channel_mask(void);
+int dma_find_free_channels(int *channels, int max);
+int dma_channel_choose(void);  // -1 if no channel is free.
+void dma_cleanup_install(void);
+
+int dma4_available(void);
+volatile struct dma4_channel_header *dma4_channel_claim(int channel_number);
+void dma4_channel_start(volatile struct dma4_channel_header *channel,
+                        uint32_t cb_phys_addr);
+void dma4_channel_stop(volatile struct dma4_channel_header *channel);
+int dma4_channel_choose(void);  // -1 if no DMA4 channel is free.
+
+// -- Sending records
+int gpiodma_record_chain_length(int n);
+int gpiodma_build_record_chain(const struct UncachedMemBlock *cb_block,
+                               struct dma_cb *cbs,
+                               const struct UncachedMemBlock *data_block,
+                               struct GPIORegData *records, int n,
+                               uint32_t next);
+
+int DMAStream_init(struct DMAStream *stream, int channel_number,
+                   int num_chunks, int chunk_records,
+                   DMAStreamFillFun fill, void *user_data);
+void DMAStream_start(struct DMAStream *stream);
+int DMAStream_refill(struct DMAStream *stream);
+void DMAStream_free(struct DMAStream *stream);
+void DMAStream_footprint(const struct DMAStream *stream,
+                         struct DMAFootprint *fp);
+
+int DMALoop_init(struct DMALoop *loop, int channel_number, int max_records);
+int DMALoop_start(struct DMALoop *loop,
+                  const struct GPIORegData *records, int n);
+int DMALoop_commit(struct DMALoop *loop,
+                   const struct GPIORegData *records, int n);
+int DMALoop_switched(const struct DMALoop *loop);
+void DMALoop_free(struct DMALoop *loop);
+void DMALoop_footprint(const struct DMALoop *loop, struct DMAFootprint *fp);
+
+// -- Capturing inputs
+int DMACapture_init(struct DMACapture *capture, int channel_number,
+                    int num_samples, int timestamps);
+double DMACapture_start(struct DMACapture *capture, double sample_rate);
+int DMACapture_drain(struct DMACapture *capture,
+                     DMACaptureFun fun, void *user_data);
+void DMACapture_free(struct DMACapture *capture);
+void DMACapture_footprint(const struct DMACapture *capture,
+                          struct DMAFootprint *fp);
+
+#endif  // GPIODMA_H
@@ -42,16 +42,18 @@ https://github.com/raspberrypi/userland/blob/master/host_applications/linux/apps
 
 #define PAGE_SIZE (4*1024)
 
+/* /dev/mem is opened once and kept open for all mappings */
+static int mem_fd = -1;
+
 void *mapmem(unsigned base, unsigned size)
 {
-   int mem_fd;
    unsigned offset = base % PAGE_SIZE;
    base = base - offset;
    size = size + offset;
    /* open /dev/mem */
-   if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-      printf("can't open /dev/mem\nThis program should be run as root. Try prefixing command with: sudo\n");
-      exit (-1);
+   if (mem_fd < 0 && (mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
+      fprintf(stderr, "can't open /dev/mem\nThis program should be run as root. Try prefixing command with: sudo\n");
+      return NULL;
    }
    void *mem = mmap(
       0,
@@ -64,10 +66,9 @@ void *mapmem(unsigned base, unsigned size)
    printf("base=0x%x, mem=%p\n", base, mem);
 #endif
    if (mem == MAP_FAILED) {
-      printf("mmap error %d\n", (int)mem);
-      exit (-1);
+      perror("mmap");
+      return NULL;
    }
-   close(mem_fd);
    return (char *)mem + offset;
 }
 
@@ -78,8 +79,7 @@ void unmapmem(void *addr, unsigned size)
    size = size + offset;
    int s = munmap(addr, size);
    if (s != 0) {
-      printf("munmap error %d\n", s);
-      exit (-1);
+      perror("munmap");
    }
 }
 
@@ -181,6 +181,143 @@ unsigned mem_unlock(int file_desc, unsigned handle)
    return p[5];
 }
 
+/*
+ * Batched property calls: several tags in one message, so that allocating
+ * or releasing many blocks only needs a few round-trips to the VideoCore.
+ * The tags are processed in order; however, a tag can't use the result of
+ * a previous tag in the same message, so e.g. the handles from a batch of
+ * mem_alloc need to be locked in a second batch.
+ */
+
+void mbox_batch_init(struct mbox_batch *b)
+{
+   b->len = 0;
+   b->buf[b->len++] = 0; // size
+   b->buf[b->len++] = 0x00000000; // process request
+}
+
+int mbox_batch_add(struct mbox_batch *b, unsigned tag, const unsigned *values, int num_values)
+{
+   // Tag header, values and the end tag that mbox_batch_send() adds.
+   if (b->len + 3 + num_values + 1 > MBOX_BATCH_MAX_WORDS)
+      return -1;
+   b->buf[b->len++] = tag;
+   b->buf[b->len++] = num_values * sizeof(unsigned); // (size of the buffer)
+   b->buf[b->len++] = num_values * sizeof(unsigned); // (size of the data)
+   const int result_index = b->len;
+   memcpy(&b->buf[b->len], values, num_values * sizeof(unsigned));
+   b->len += num_values;
+   return result_index;
+}
+
+int mbox_batch_send(int file_desc, struct mbox_batch *b)
+{
+   b->buf[b->len] = 0x00000000; // end tag
+   b->buf[0] = (b->len + 1) * sizeof(unsigned); // actual size
+   if (mbox_property(file_desc, b->buf) < 0)
+      return -1;
+   return b->buf[1] == 0x80000000 ? 0 : -1; // request successful ?
+}
+
+int mbox_batch_tag_ok(const struct mbox_batch *b, int result_index)
+{
+   // The word before the values has bit 31 set once the tag got a response.
+   return (b->buf[result_index - 1] & 0x80000000) != 0;
+}
+
+// Tags per message in the *_batch functions, to keep messages small.
+#define MBOX_TAGS_PER_BATCH 32
+
+int mem_alloc_batch(int file_desc, int n, const unsigned *sizes, unsigned align, unsigned flags, unsigned *handles)
+{
+   // Whatever happens, the caller gets 0 for what wasn't allocated.
+   memset(handles, 0, n * sizeof(*handles));
+   for (int done = 0; done < n; /**/) {
+      struct mbox_batch b;
+      int result[MBOX_TAGS_PER_BATCH];
+      const int count = (n - done) > MBOX_TAGS_PER_BATCH ? MBOX_TAGS_PER_BATCH : (n - done);
+      mbox_batch_init(&b);
+      for (int i = 0; i < count; ++i) {
+         const unsigned request[3] = { sizes[done + i], align, flags };
+         result[i] = mbox_batch_add(&b, 0x3000c, request, 3);
+         if (result[i] < 0)
+            return -1;
+      }
+      if (mbox_batch_send(file_desc, &b) < 0)
+         return -1;
+      int failed = 0;
+      for (int i = 0; i < count; ++i) {
+         if (mbox_batch_tag_ok(&b, result[i]))
+            handles[done + i] = b.buf[result[i]]; // 0 if out of memory.
+         if (handles[done + i] == 0)
+            failed = 1;
+      }
+      if (failed)
+         return -1;
+      done += count;
+   }
+   return 0;
+}
+
+int mem_lock_batch(int file_desc, int n, const unsigned *handles, unsigned *bus_addrs)
+{
+   memset(bus_addrs, 0, n * sizeof(*bus_addrs));
+   for (int done = 0; done < n; /**/) {
+      struct mbox_batch b;
+      int result[MBOX_TAGS_PER_BATCH];
+      const int count = (n - done) > MBOX_TAGS_PER_BATCH ? MBOX_TAGS_PER_BATCH : (n - done);
+      mbox_batch_init(&b);
+      for (int i = 0; i < count; ++i) {
+         result[i] = mbox_batch_add(&b, 0x3000d, &handles[done + i], 1);
+         if (result[i] < 0)
+            return -1;
+      }
+      if (mbox_batch_send(file_desc, &b) < 0)
+         return -1;
+      int failed = 0;
+      for (int i = 0; i < count; ++i) {
+         if (mbox_batch_tag_ok(&b, result[i]))
+            bus_addrs[done + i] = b.buf[result[i]]; // 0 if not locked.
+         if (bus_addrs[done + i] == 0)
+            failed = 1;
+      }
+      if (failed)
+         return -1;
+      done += count;
+   }
+   return 0;
+}
+
+int mem_release_batch(int file_desc, int n, const unsigned *handles)
+{
+   // Unlock and free in the same message: the tags are processed in order.
+   // Keep going on errors, to release as much as possible.
+   int err = 0;
+   for (int done = 0; done < n; /**/) {
+      struct mbox_batch b;
+      int result[MBOX_TAGS_PER_BATCH];
+      const int count = (n - done) > MBOX_TAGS_PER_BATCH / 2 ? MBOX_TAGS_PER_BATCH / 2 : (n - done);
+      mbox_batch_init(&b);
+      for (int i = 0; i < count; ++i) {
+         result[2*i] = mbox_batch_add(&b, 0x3000e, &handles[done + i], 1);
+         result[2*i+1] = mbox_batch_add(&b, 0x3000f, &handles[done + i], 1);
+         if (result[2*i] < 0 || result[2*i+1] < 0)
+            return -1;
+      }
+      if (mbox_batch_send(file_desc, &b) < 0) {
+         err = -1;
+      } else {
+         for (int i = 0; i < 2 * count; ++i) {
+            // Both return 0 on success.
+            if (!mbox_batch_tag_ok(&b, result[i]) || b.buf[result[i]] != 0)
+               err = -1;
+         }
+      }
+      done += count;
+   }
+   return err;
+}
+
 unsigned execute_code(int file_desc, unsigned code, unsigned r0, unsigned r1, unsigned r2, unsigned r3, unsigned r4, unsigned r5)
 {
    int i=0;
@@ -247,15 +384,15 @@ unsigned execute_qpu(int file_desc, unsigned num_qpus, unsigned control, unsigne
    return p[5];
 }
 
-int mbox_open() {
+int mbox_open(void) {
    int file_desc;
 
    // open a char device file used for communicating with kernel mbox driver
    file_desc = open(DEVICE_FILE_NAME, 0);
    if (file_desc < 0) {
-      printf("Can't open device file: %s\n", DEVICE_FILE_NAME);
-      printf("Try creating a device file with: sudo mknod %s c %d 0\n", DEVICE_FILE_NAME, MAJOR_NUM);
-      exit(-1);
+      fprintf(stderr, "Can't open device file: %s\n", DEVICE_FILE_NAME);
+      fprintf(stderr, "Try creating a device file with: sudo mknod %s c %d 0\n", DEVICE_FILE_NAME, MAJOR_NUM);
+      return -1;
    }
    return file_desc;
 }
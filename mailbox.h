@@ -34,7 +34,7 @@ https://github.com/raspberrypi/userland/blob/master/host_applications/linux/apps
 #define IOCTL_MBOX_PROPERTY _IOWR(MAJOR_NUM, 0, char *)
 #define DEVICE_FILE_NAME "/dev/vcio"
 
-int mbox_open();
+int mbox_open(void);  // -1 on failure.
 void mbox_close(int file_desc);
 
 unsigned get_version(int file_desc);
@@ -42,9 +42,29 @@ unsigned mem_alloc(int file_desc, unsigned size, unsigned align, unsigned flags)
 unsigned mem_free(int file_desc, unsigned handle);
 unsigned mem_lock(int file_desc, unsigned handle);
 unsigned mem_unlock(int file_desc, unsigned handle);
-void *mapmem(unsigned base, unsigned size);
+void *mapmem(unsigned base, unsigned size);  // NULL on failure.
 void unmapmem(void *addr, unsigned size);
 
+// Several property tags, sent with a single ioctl.
+#define MBOX_BATCH_MAX_WORDS 256
+struct mbox_batch {
+   unsigned buf[MBOX_BATCH_MAX_WORDS];
+   int len;
+};
+void mbox_batch_init(struct mbox_batch *b);
+// Returns the index in buf[] where the tag's response values will be, or -1 if full.
+int mbox_batch_add(struct mbox_batch *b, unsigned tag, const unsigned *values, int num_values);
+// Returns -1 if the ioctl() or the request as a whole failed.
+int mbox_batch_send(int file_desc, struct mbox_batch *b);
+// Returns if the tag with its values at "result_index" got a response.
+int mbox_batch_tag_ok(const struct mbox_batch *b, int result_index);
+
+// Allocate, lock and release (unlock + free) "n" blocks in as few calls as possible.
+// Return -1 if any failed; handles and bus_addrs are 0 for the ones that did.
+int mem_alloc_batch(int file_desc, int n, const unsigned *sizes, unsigned align, unsigned flags, unsigned *handles);
+int mem_lock_batch(int file_desc, int n, const unsigned *handles, unsigned *bus_addrs);
+int mem_release_batch(int file_desc, int n, const unsigned *handles);
+
 unsigned execute_code(int file_desc, unsigned code, unsigned r0, unsigned r1, unsigned r2, unsigned r3, unsigned r4, unsigned r5);
 unsigned execute_qpu(int file_desc, unsigned num_qpus, unsigned control, unsigned noflush, unsigned timeout);
 unsigned qpu_enable(int file_desc, unsigned enable);